@@ -54,6 +54,19 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *  CONFIG_INITRAMFS_SOURCE=/boot/initramfs-source
  * to build the initramfs into your kernel image
  *  that also has builtin drivers (spl and zfs, etc).
+ *
+ * Drivers built as modules can be loaded instead: copy them, with
+ * modules.dep and modules.builtin, to lib/modules/`uname -r`/ and name
+ * them in modules_load= or in etc/modules.
+ *
+ * A build can be tried without rebooting or root: "make test" boots it as
+ * PID 1 of new user, mount and PID namespaces and checks what a stub real
+ * init receives; "make bench" times the boot phases over
+ * repeated runs. test/harness.sh describes the setup: a tmpfs initramfs
+ * with the command line in a file (-DPROC_CMDLINE='"/cmdline"'), and a
+ * private /dev and fake /sys that are mount points already. Those are used
+ * as they are, so the run touches neither the host's devtmpfs nor its
+ * sysfs, and /dev/.foobarz-init.timeline holds the time of each phase.
  */
 
 #define FOOBARZ_INIT_VERSION "1.1.2"
@@ -67,6 +80,32 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sysexits.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/swap.h>
+#include <stdint.h>
+#include <elf.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <linux/fiemap.h>
+#include <linux/fanotify.h>
+#include <linux/io_uring.h>
+#include <linux/loop.h>
+#ifndef FS_IOC_FIEMAP /* <linux/fs.h> clashes with <sys/mount.h> */
+#define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap)
+#endif
 /* support for zpool import
  * 
  * If -DINCLUDE_ZPOOL_IMPORT, then support to import a zpool is
@@ -86,7 +125,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * options for tirpc.
  * 
  * Otherwise, with -UINCLUDE_ZPOOL_IMPORT, the compile is just:
- * gcc -static foobarz-init.c -o init
+ * gcc -static foobarz-init.c -o init -lpthread
+ *
+ * -DINCLUDE_TINY is a minimal formatter build: it formats its messages
+ * itself and uses no stdio, so a small static libc links neither printf nor
+ * FILE support. It does not make a freestanding or few-KB init: the stage
+ * threads keep malloc and pthreads and the libc stays linked, and no size
+ * goal has been met or measured with musl. glibc links its own stdio into
+ * any static program, so there it makes no smaller binary at all. "make
+ * tiny" builds it with musl-gcc, or $(CC) when that is missing, and reports
+ * its size and the time from exec to the first log line, next to those of
+ * a build with the same flags but without -DINCLUDE_TINY.
  */
 #if defined(INCLUDE_ZPOOL_IMPORT)
 #include <libzfs.h>
@@ -95,263 +144,3530 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/stat.h>
 #endif
 
+/* support for compressed kernel modules
+ *
+ * Kernels since 5.17 with CONFIG_MODULE_DECOMPRESS decompress modules
+ * themselves. For other kernels, -DINCLUDE_MODULE_XZ (link with -llzma)
+ * and -DINCLUDE_MODULE_ZSTD (link with -lzstd) let this program load
+ * .ko.xz and .ko.zst modules; see modules_load= below.
+ */
+#if defined(INCLUDE_MODULE_XZ)
+#include <lzma.h>
+#endif
+#if defined(INCLUDE_MODULE_ZSTD)
+#include <zstd.h>
+#endif
+
 #define PARAM_REQ_NO 0
 #define PARAM_REQ_YES 1
 #define PARAM_SRC_DEFAULT 0
 #define PARAM_SRC_CMDLINE 1
 
-void printk(char *fmt, ...) {
-  FILE* f;
-  int fd;
-  va_list args;
+/*** fmt: minimal formatter for -DINCLUDE_TINY builds, and fd output
+ *
+ * The minimal formatter build formats with tiny_vsnprintf() instead of the libc printf
+ * family, which keeps vfprintf, its locale support and its floating point
+ * out of a static libc that does not already link them itself. It knows
+ * what this program uses: the flags '-' and '0', a width and a precision
+ * (either may be '*'), the h, hh, l, ll and z sizes, and %d %i %u %x %X %c
+ * %s %p %%.
+ *
+ * fdout_printf() writes formatted lines to a file through a small buffer,
+ * in either build, so that stdio is not needed for the files this program
+ * writes.
+ */
+#if defined(INCLUDE_TINY)
+int tiny_vsnprintf(char* buf, size_t size, const char* fmt, va_list ap) {
+  char num[24];
+  const char* s;
+  size_t out = 0;
+  unsigned long long u;
+  long long d;
+  int left, zero, width, prec, lng, base, upper, neg, len, pad;
+
+#define TINY_PUT(c) do { if( out + 1 < size ) buf[out] = (c); out++; } while( 0 )
+  for( ; *fmt != '\0'; fmt++ ) {
+    if( *fmt != '%' ) {
+      TINY_PUT(*fmt);
+      continue;
+    }
+    left = zero = width = lng = neg = 0;
+    prec = -1;
+    for( fmt++; (*fmt == '-') || (*fmt == '0'); fmt++ ) {
+      if( *fmt == '-' ) left = 1;
+      else zero = 1;
+    }
+    if( *fmt == '*' ) {
+      width = va_arg(ap, int);
+      fmt++;
+    } else while( (*fmt >= '0') && (*fmt <= '9') ) width = width * 10 + (*fmt++ - '0');
+    if( *fmt == '.' ) {
+      prec = 0;
+      if( *++fmt == '*' ) {
+        prec = va_arg(ap, int);
+        fmt++;
+      } else while( (*fmt >= '0') && (*fmt <= '9') ) prec = prec * 10 + (*fmt++ - '0');
+    }
+    for( ; (*fmt == 'h') || (*fmt == 'l') || (*fmt == 'z'); fmt++ ) {
+      if( *fmt == 'l' ) lng++;
+      else if( *fmt == 'z' ) lng = (sizeof(size_t) > sizeof(int)) ? 2 : 0;
+    }
+    s = num;
+    len = 0;
+    base = 10;
+    upper = 0;
+    switch( *fmt ) {
+    case 'd': case 'i':
+      d = (lng >= 2) ? va_arg(ap, long long) : (lng == 1) ? va_arg(ap, long) : va_arg(ap, int);
+      neg = (d < 0);
+      u = neg ? -(unsigned long long) d : (unsigned long long) d;
+      goto number;
+    case 'p':
+      u = (unsigned long) va_arg(ap, void*);
+      base = 16;
+      goto number;
+    case 'X':
+      upper = 1;
+      /* fall through */
+    case 'x':
+      base = 16;
+      /* fall through */
+    case 'u':
+      u = (lng >= 2) ? va_arg(ap, unsigned long long) : (lng == 1) ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+    number:
+      do {
+        num[sizeof(num) - 1 - len++] = (upper ? "0123456789ABCDEF" : "0123456789abcdef")[u % base];
+        u /= base;
+      } while( u != 0 );
+      s = num + sizeof(num) - len;
+      break;
+    case 'c':
+      num[0] = (char) va_arg(ap, int);
+      len = 1;
+      break;
+    case 's':
+      s = va_arg(ap, const char*);
+      if( s == NULL ) s = "(null)";
+      for( len = 0; (s[len] != '\0') && ((prec < 0) || (len < prec)); len++ );
+      break;
+    case '%':
+      num[0] = '%';
+      len = 1;
+      break;
+    default:
+      /* not in this program */
+      if( *fmt == '\0' ) fmt--;
+      continue;
+    }
+    pad = width - len - neg;
+    if( neg && zero ) TINY_PUT('-');
+    while( !left && (pad-- > 0) ) TINY_PUT(zero ? '0' : ' ');
+    if( neg && !zero ) TINY_PUT('-');
+    while( len-- > 0 ) TINY_PUT(*s++);
+    while( left && (pad-- > 0) ) TINY_PUT(' ');
+  }
+  if( size > 0 ) buf[(out < size) ? out : size - 1] = '\0';
+#undef TINY_PUT
+  return (int) out;
+}
+
+int tiny_snprintf(char* buf, size_t size, const char* fmt, ...) {
+  va_list ap;
+  int ret;
+
+  va_start(ap, fmt);
+  ret = tiny_vsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return ret;
+}
+#define vsnprintf tiny_vsnprintf
+#define snprintf  tiny_snprintf
+#endif
+
+struct fdout { int fd; int err; size_t len; char buf[4096]; };
+
+static void fdout_flush(struct fdout* o) {
+  size_t done;
+  ssize_t n;
+
+  for( done = 0; done < o->len; done += n ) {
+    n = write(o->fd, o->buf + done, o->len - done);
+    if( n <= 0 ) {
+      o->err = 1;
+      break;
+    }
+  }
+  o->len = 0;
+}
+
+void fdout_printf(struct fdout* o, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void fdout_printf(struct fdout* o, const char* fmt, ...) {
+  va_list ap;
+  char line[1024];
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if( (len < 0) || ((size_t) len >= sizeof(line)) ) {
+    o->err = 1;
+    return;
+  }
+  if( o->len + len > sizeof(o->buf) ) fdout_flush(o);
+  memcpy(o->buf + o->len, line, len);
+  o->len += len;
+}
+
+/* flush and close; -1 if anything was lost */
+int fdout_close(struct fdout* o) {
+  fdout_flush(o);
+  if( close(o->fd) != 0 ) o->err = 1;
+  return o->err ? -1 : 0;
+}
+
+/*** klog: buffered kernel message logger
+ *
+ * printk() formats a line into klog_buf; klog_flush() writes pending lines to
+ * a single /dev/kmsg fd that stays open (O_CLOEXEC, so the real init does not
+ * inherit it). A line may start with a KERN_* "<N>" level prefix like in the
+ * kernel; lines at or above the init_loglevel= threshold are dropped.
+ *
+ * Each write to /dev/kmsg is one kernel record, with one level. Unless
+ * printk.devkmsg=on, the kernel accepts only DEVKMSG_BURST records per
+ * DEVKMSG_INTERVAL_MS on each open file and silently drops the rest. klog
+ * keeps the same account as a bucket of DEVKMSG_BURST tokens, refilled when
+ * the interval is over: a record takes a token, and while more lines are
+ * pending than there are tokens, a record carries a run of lines of the same
+ * level (one writev). Lines the bucket cannot take are held for the next
+ * interval; when the buffer is full the oldest held line is dropped, and the
+ * count of those is logged once there is a token for it. Logging never
+ * sleeps. klog_flush_all(), last before exec, writes what is still held
+ * regardless; the kernel counts what it drops of that and reports the count
+ * when the fd is closed.
+ *
+ * printk() may be called from several threads; a thread that has set a
+ * capture with klog_capture() keeps its lines until klog_capture_release().
+ */
+#define KERN_EMERG   "<0>"
+#define KERN_ALERT   "<1>"
+#define KERN_CRIT    "<2>"
+#define KERN_ERR     "<3>"
+#define KERN_WARNING "<4>"
+#define KERN_NOTICE  "<5>"
+#define KERN_INFO    "<6>"
+#define KERN_DEBUG   "<7>"
+#define KLOG_DEFAULT_LEVEL 6 /* level of lines without a prefix */
+
+#define KLOG_BUFSIZE   8192
+#define KLOG_MAXLINES  64
+#define KLOG_RECMAX    1020 /* kernel rejects records over 1024B */
+#define KLOG_LINEMAX   992
+#define DEVKMSG_BURST  10   /* kernel DEFAULT_RATELIMIT_BURST */
+#define DEVKMSG_INTERVAL_MS 5100 /* DEFAULT_RATELIMIT_INTERVAL + jiffy slack */
+
+static int klog_fd = -1;
+static int klog_threshold = 8; /* log lines with level < threshold */
+static int klog_ratelimited = 1;
+static char klog_buf[KLOG_BUFSIZE];
+static size_t klog_used = 0;
+static struct { int level; size_t off; size_t len; } klog_line[KLOG_MAXLINES];
+static int klog_nlines = 0;
+static struct timespec klog_window; /* start of current ratelimit window */
+static int klog_sent = 0;           /* records sent in current window */
+static int klog_dropped = 0;        /* held lines dropped, not reported yet */
+static pthread_mutex_t klog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* lines of a boot stage are held back while an earlier stage is still
+ * logging, so that concurrent stages do not interleave; see dag_run().
+ * A capture made inside another one releases its lines to the outer one. */
+struct klog_capture { char* buf; size_t len; size_t size; int direct; struct klog_capture* parent; };
+static __thread struct klog_capture* klog_cap = NULL;
+
+static long klog_ms_since(struct timespec* t) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void klog_open(void) {
+  struct stat st;
+
+  klog_fd = open("/dev/kmsg", O_WRONLY | O_NOCTTY | O_CLOEXEC);
+  /* printk.devkmsg=off refuses writers; fall back to the console */
+  if( klog_fd == -1 ) klog_fd = STDERR_FILENO;
+  /* only the kernel's device counts records; a test may give a fifo */
+  else if( (fstat(klog_fd, &st) == 0) && !S_ISCHR(st.st_mode) ) klog_ratelimited = 0;
+  clock_gettime(CLOCK_MONOTONIC, &klog_window);
+  klog_sent = 0;
+}
+
+/* tokens left: records that can still be written without being dropped */
+static int klog_budget(void) {
+  if( !klog_ratelimited || (klog_fd == STDERR_FILENO) ) return KLOG_MAXLINES;
+  if( klog_ms_since(&klog_window) > DEVKMSG_INTERVAL_MS ) {
+    clock_gettime(CLOCK_MONOTONIC, &klog_window);
+    klog_sent = 0;
+  }
+  return DEVKMSG_BURST - klog_sent;
+}
+
+/* write one record; a failed write to /dev/kmsg falls back to the console */
+static void klog_write(int level, struct iovec* iov, int n) {
+  char prefix[8];
+
+  if( klog_fd != STDERR_FILENO ) {
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = snprintf(prefix, sizeof(prefix), "<%d>", level);
+    while( writev(klog_fd, iov, n) == -1 ) {
+      if( errno == EINTR ) continue;
+      close(klog_fd);
+      klog_fd = STDERR_FILENO;
+      break;
+    }
+    klog_sent++;
+    if( klog_fd != STDERR_FILENO ) return;
+  }
+  while( (writev(STDERR_FILENO, iov + 1, n - 1) == -1) && (errno == EINTR) );
+}
+
+/* write lines [first, last), all of one level, as a single record */
+static void klog_record(int first, int last) {
+  struct iovec iov[2*KLOG_MAXLINES + 1];
+  int i, n = 1;
+
+  for( i=first; i<last; i++ ) {
+    iov[n].iov_base = klog_buf + klog_line[i].off;
+    iov[n++].iov_len = klog_line[i].len;
+    iov[n].iov_base = "\n";
+    iov[n++].iov_len = 1;
+  }
+  klog_write(klog_line[first].level, iov, n);
+}
+
+/* forget the first n pending lines; those held move to the front */
+static void klog_shift(int n) {
+  size_t off = (n < klog_nlines) ? klog_line[n].off : klog_used;
+  int i;
+
+  memmove(klog_buf, klog_buf + off, klog_used - off);
+  klog_used -= off;
+  for( i=n; i<klog_nlines; i++ ) {
+    klog_line[i - n] = klog_line[i];
+    klog_line[i - n].off -= off;
+  }
+  klog_nlines -= n;
+}
+
+/* write the pending lines the budget allows, or all of them; hold the rest */
+static void klog_flush_budget(int all) {
+  struct iovec iov[2];
+  char note[80];
+  int budget, i = 0, n;
+  size_t len;
+  int saved_errno = errno;
+
+  if( klog_fd == -1 ) klog_open();
+  if( (klog_dropped > 0) && (all || (klog_budget() > 0)) ) {
+    iov[1].iov_base = note;
+    iov[1].iov_len = snprintf(note, sizeof(note), "%d log lines dropped by the /dev/kmsg ratelimit.\n", klog_dropped);
+    klog_write(4, iov, 2);
+    klog_dropped = 0;
+  }
+  while( i < klog_nlines ) {
+    budget = all ? KLOG_MAXLINES : klog_budget();
+    if( budget <= 0 ) break;
+    /* more lines than tokens: a record takes a run of one level */
+    n = i + 1;
+    len = klog_line[i].len + 1;
+    if( all || (klog_nlines - i > budget) ) {
+      while( (n < klog_nlines) && (klog_line[n].level == klog_line[i].level) && (len + klog_line[n].len + 1 <= KLOG_RECMAX) ) {
+        len += klog_line[n].len + 1;
+        n++;
+      }
+    }
+    klog_record(i, n);
+    i = n;
+  }
+  klog_shift(i);
+  errno = saved_errno;
+}
+
+static void klog_flush_locked(void) {
+  klog_flush_budget(0);
+}
+
+void klog_flush(void) {
+  pthread_mutex_lock(&klog_lock);
+  klog_flush_locked();
+  pthread_mutex_unlock(&klog_lock);
+}
+
+void klog_flush_all(void) {
+  pthread_mutex_lock(&klog_lock);
+  klog_flush_budget(1);
+  pthread_mutex_unlock(&klog_lock);
+}
+
+static void klog_store(int level, const char* text, size_t len) {
+  int i;
+
+  if( (klog_nlines == KLOG_MAXLINES) || (KLOG_BUFSIZE - klog_used < len) )
+    klog_flush_locked();
+  /* still full: make room by dropping the oldest held lines */
+  for( i=0; (i < klog_nlines) && ((klog_nlines - i == KLOG_MAXLINES) || (KLOG_BUFSIZE - klog_used + klog_line[i].off < len)); i++ );
+  klog_shift(i);
+  klog_dropped += i;
+  memcpy(klog_buf + klog_used, text, len);
+  klog_line[klog_nlines].level = level;
+  klog_line[klog_nlines].off = klog_used;
+  klog_line[klog_nlines].len = len;
+  klog_nlines++;
+  klog_used += len;
+
+  /* errors go out at once; the rest waits for the next klog_flush() */
+  if( level <= 3 ) klog_flush_locked();
+}
+
+/* keep "<N>text\n" in a capture buffer; on allocation failure, log directly */
+static void klog_capture_store(struct klog_capture* cap, int level, const char* text, size_t len) {
+  char* buf;
+  size_t size;
+
+  if( cap->len + len + 4 > cap->size ) {
+    size = cap->size ? 2*cap->size : 1024;
+    while( size < cap->len + len + 4 ) size *= 2;
+    buf = realloc(cap->buf, size);
+    if( buf == NULL ) {
+      klog_store(level, text, len);
+      return;
+    }
+    cap->buf = buf;
+    cap->size = size;
+  }
+  cap->buf[cap->len++] = '<';
+  cap->buf[cap->len++] = '0' + level;
+  cap->buf[cap->len++] = '>';
+  memcpy(cap->buf + cap->len, text, len);
+  cap->len += len;
+  cap->buf[cap->len++] = '\n';
+}
+
+/* klog_lock held; the capture that lines for cap go to, or NULL for kmsg */
+static struct klog_capture* klog_capture_target(struct klog_capture* cap) {
+  while( (cap != NULL) && cap->direct ) cap = cap->parent;
+  return cap;
+}
+
+/* log what was captured so far; later lines on cap go straight to kmsg,
+ * or to the capture cap is nested in */
+void klog_capture_release(struct klog_capture* cap) {
+  struct klog_capture* to;
+  char* p;
+  char* nl;
+
+  pthread_mutex_lock(&klog_lock);
+  to = klog_capture_target(cap->parent);
+  for( p = cap->buf; (p != NULL) && (p < cap->buf + cap->len); p = nl + 1 ) {
+    nl = memchr(p, '\n', cap->buf + cap->len - p);
+    if( to != NULL ) klog_capture_store(to, p[1] - '0', p + 3, nl - (p + 3));
+    else klog_store(p[1] - '0', p + 3, nl - (p + 3));
+  }
+  free(cap->buf);
+  cap->buf = NULL;
+  cap->len = cap->size = 0;
+  cap->direct = 1;
+  pthread_mutex_unlock(&klog_lock);
+}
+
+/* lines printed by this thread go to cap, or to kmsg if cap is NULL */
+void klog_capture(struct klog_capture* cap) {
+  klog_cap = cap;
+}
+
+/* called once /proc is mounted */
+void klog_probe_ratelimit(void) {
+  char mode[16];
+  ssize_t n;
+  int fd;
+
+  fd = open("/proc/sys/kernel/printk_devkmsg", O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return;
+  n = read(fd, mode, sizeof(mode)-1);
+  close(fd);
+  if( n <= 0 ) return;
+  mode[n] = '\0';
+  klog_ratelimited = (strncmp(mode, "on", 2) != 0);
+}
+
+void klog_set_threshold(int level) {
+  klog_threshold = level;
+}
+
+void printk(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void printk(char *fmt, ...) {
+  va_list args;
+  struct klog_capture* cap;
+  char buf[KLOG_LINEMAX];
+  char* line = buf;
+  int len, level = KLOG_DEFAULT_LEVEL;
+  int saved_errno = errno;
+
+  va_start(args, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  errno = saved_errno;
+  if( len < 0 ) return;
+  if( (size_t) len >= sizeof(buf) ) len = sizeof(buf) - 1;
+
+  if( (len >= 3) && (line[0] == '<') && (line[1] >= '0') && (line[1] <= '7') && (line[2] == '>') ) {
+    level = line[1] - '0';
+    line += 3;
+    len -= 3;
+  }
+  if( level >= klog_threshold ) return;
+  while( (len > 0) && (line[len-1] == '\n') ) len--;
+
+  pthread_mutex_lock(&klog_lock);
+  cap = klog_capture_target(klog_cap);
+  if( cap != NULL ) klog_capture_store(cap, level, line, len);
+  else klog_store(level, line, len);
+  pthread_mutex_unlock(&klog_lock);
+  errno = saved_errno;
+}
+
+/*** timeline: per-phase boot timing
+ *
+ * timeline_begin() and timeline_end() stamp CLOCK_BOOTTIME and CLOCK_MONOTONIC
+ * at the boundaries of a phase. Before exec, timeline_report() prints a table
+ * to kmsg and timeline_write() leaves a machine-readable copy in the devtmpfs
+ * that was moved to the new root, so it survives into the real init as
+ * TIMELINE_PATH. One line per phase, times in microseconds:
+ *
+ *   # foobarz-init <version> timeline v1
+ *   # phase boottime_begin boottime_end monotonic_begin monotonic_end
+ *   mount_proc 1830412 1830519 1830398 1830505
+ *
+ * An end of 0 means the phase never finished.
+ */
+#define TIMELINE_MAX  48
+#define TIMELINE_PATH "/dev/.foobarz-init.timeline"
+
+static struct {
+  const char* name;
+  struct timespec boot[2];
+  struct timespec mono[2];
+} tl_phase[TIMELINE_MAX];
+static int tl_nphases = 0;
+static int tl_reported = 0;
+static pthread_mutex_t tl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long tl_us(struct timespec* t) {
+  return (long long) t->tv_sec * 1000000 + t->tv_nsec / 1000;
+}
+
+/* returns a slot for timeline_end(), or -1 if the table is full */
+int timeline_begin(const char* name) {
+  int slot;
+
+  pthread_mutex_lock(&tl_lock);
+  if( tl_nphases == TIMELINE_MAX ) slot = -1;
+  else slot = tl_nphases++;
+  pthread_mutex_unlock(&tl_lock);
+  if( slot < 0 ) return -1;
+  tl_phase[slot].name = name;
+  clock_gettime(CLOCK_BOOTTIME, &tl_phase[slot].boot[0]);
+  clock_gettime(CLOCK_MONOTONIC, &tl_phase[slot].mono[0]);
+  return slot;
+}
+
+void timeline_end(int slot) {
+  if( slot < 0 ) return;
+  clock_gettime(CLOCK_BOOTTIME, &tl_phase[slot].boot[1]);
+  clock_gettime(CLOCK_MONOTONIC, &tl_phase[slot].mono[1]);
+}
+
+void timeline_report(void) {
+  long long origin, begin, end;
+  int i;
+
+  if( (tl_nphases == 0) || tl_reported ) return;
+  tl_reported = 1;
+  origin = tl_us(&tl_phase[0].boot[0]);
+  printk("timeline: %-20s %10s %10s  (boottime at start: %lld us)\n", "phase", "start_us", "length_us", origin);
+  for( i=0; i<tl_nphases; i++ ) {
+    begin = tl_us(&tl_phase[i].boot[0]);
+    end   = tl_us(&tl_phase[i].boot[1]);
+    if( end == 0 )
+      printk("timeline: %-20s %10lld %10s\n", tl_phase[i].name, begin - origin, "unfinished");
+    else
+      printk("timeline: %-20s %10lld %10lld\n", tl_phase[i].name, begin - origin, end - begin);
+  }
+  klog_flush();
+}
+
+int timeline_write(const char* path) {
+  static struct fdout f;
+  int i;
+
+  f.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if( f.fd == -1 ) return -1;
+  fdout_printf(&f, "# foobarz-init %s timeline v1\n", FOOBARZ_INIT_VERSION);
+  fdout_printf(&f, "# phase boottime_begin boottime_end monotonic_begin monotonic_end\n");
+  for( i=0; i<tl_nphases; i++ )
+    fdout_printf(&f, "%s %lld %lld %lld %lld\n", tl_phase[i].name,
+                 tl_us(&tl_phase[i].boot[0]), tl_us(&tl_phase[i].boot[1]),
+                 tl_us(&tl_phase[i].mono[0]), tl_us(&tl_phase[i].mono[1]));
+  return fdout_close(&f);
+}
+
+/*** blockdev_wait: event-driven wait for a block device
+ *
+ * Used by rootwait and rootdelay. The uevent socket is bound before
+ * /sys/class/block is scanned, so a device that appears in between is not
+ * missed; after that the loop only wakes for kernel uevents. devtmpfs has
+ * created the /dev node by the time the add uevent is sent. Without
+ * CONFIG_NET there is no uevent socket and /sys/class/block is rescanned
+ * every BLOCKDEV_POLL_MS instead.
+ */
+#define BLOCKDEV_POLL_MS 50
+#define UEVENT_BUFSIZE   8192
+
+typedef int (*blockdev_match_fn)(const char* devname, void* arg);
+
+static int blockdev_match_name(const char* devname, void* arg) {
+  return strcmp(devname, (const char*) arg) == 0;
+}
+
+/* returns 1 if a device in /sys/class/block matches */
+static int blockdev_scan(blockdev_match_fn match, void* arg) {
+  DIR* dir;
+  struct dirent* de;
+  int found = 0;
+
+  dir = opendir("/sys/class/block");
+  if( dir == NULL ) return 0;
+  while( !found && ((de = readdir(dir)) != NULL) ) {
+    if( de->d_name[0] == '.' ) continue;
+    found = match(de->d_name, arg);
+  }
+  closedir(dir);
+  return found;
+}
+
+/* devices not worth reading while looking for one: an empty cdrom or
+ * floppy drive can take seconds to answer */
+static int blockdev_slow(const char* devname) {
+  return (strncmp(devname, "sr", 2) == 0) || (strncmp(devname, "fd", 2) == 0);
+}
+
+static int uevent_open(void) {
+  struct sockaddr_nl nl;
+  int fd, rcvbuf = 1024*1024;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+  if( fd == -1 ) return -1;
+  memset(&nl, 0, sizeof(nl));
+  nl.nl_family = AF_NETLINK;
+  nl.nl_groups = 1; /* kernel uevents */
+  if( bind(fd, (struct sockaddr*) &nl, sizeof(nl)) != 0 ) {
+    close(fd);
+    return -1;
+  }
+  /* a burst of disks must not overflow the socket; ENOBUFS forces a rescan anyway */
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+  return fd;
+}
+
+/* value of key in a uevent message of NUL-separated KEY=value strings */
+static const char* uevent_get(const char* msg, size_t len, const char* key) {
+  size_t keylen = strlen(key);
+  const char* p = msg;
+  const char* end = msg + len;
+
+  while( p < end ) {
+    if( (strncmp(p, key, keylen) == 0) && (p[keylen] == '=') ) return p + keylen + 1;
+    p += strlen(p) + 1;
+  }
+  return NULL;
+}
+
+/* wait until a block device satisfies match; timeout_ms < 0 waits forever.
+ * returns 0 when found, -1 with errno ETIMEDOUT otherwise */
+int blockdev_wait(blockdev_match_fn match, void* arg, long timeout_ms) {
+  char msg[UEVENT_BUFSIZE];
+  struct timespec start;
+  struct pollfd pfd;
+  const char* v;
+  long left;
+  ssize_t len;
+  int fd, found;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fd = uevent_open();
+  if( fd == -1 ) printk(KERN_WARNING "blockdev_wait: no uevent socket (%s); polling /sys/class/block.\n", strerror(errno));
+  found = blockdev_scan(match, arg);
+  while( !found ) {
+    if( timeout_ms < 0 ) left = -1;
+    else {
+      left = timeout_ms - klog_ms_since(&start);
+      if( left <= 0 ) break;
+    }
+    if( fd == -1 ) {
+      if( (left < 0) || (left > BLOCKDEV_POLL_MS) ) left = BLOCKDEV_POLL_MS;
+      poll(NULL, 0, left);
+      found = blockdev_scan(match, arg);
+      continue;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if( poll(&pfd, 1, left) <= 0 ) continue;
+    while( !found && ((len = recv(fd, msg, sizeof(msg)-1, 0)) != 0) ) {
+      if( len < 0 ) {
+        /* lost events: the sysfs tree is still authoritative */
+        if( errno == ENOBUFS ) found = blockdev_scan(match, arg);
+        else if( errno != EINTR ) break;
+        continue;
+      }
+      msg[len] = '\0';
+      v = uevent_get(msg, len, "SUBSYSTEM");
+      if( (v == NULL) || (strcmp(v, "block") != 0) ) continue;
+      v = uevent_get(msg, len, "ACTION");
+      if( (v == NULL) || ((strcmp(v, "add") != 0) && (strcmp(v, "change") != 0)) ) continue;
+      v = uevent_get(msg, len, "DEVNAME");
+      if( v != NULL ) found = match(v, arg);
+    }
+  }
+  if( fd != -1 ) close(fd);
+  if( !found ) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+/* log the block devices the kernel knows about, for failure messages */
+void blockdev_list(void) {
+  char line[KLOG_LINEMAX];
+  size_t used = 0;
+  DIR* dir;
+  struct dirent* de;
+
+  line[0] = '\0';
+  dir = opendir("/sys/class/block");
+  if( dir != NULL ) {
+    while( (de = readdir(dir)) != NULL ) {
+      if( de->d_name[0] == '.' ) continue;
+      if( used + strlen(de->d_name) + 2 >= sizeof(line) ) break;
+      used += snprintf(line + used, sizeof(line) - used, " %s", de->d_name);
+    }
+    closedir(dir);
+  }
+  printk(KERN_ERR "Available block devices:%s\n", used ? line : " none");
+}
+
+/*** fsprobe: identify a filesystem by its superblock magic
+ *
+ * Used by rootfstype=auto and by blkid. One pread() of the first
+ * FSPROBE_SIZE bytes of the device covers every superblock in fsmagic[] and,
+ * for ZFS, the uberblock ring of vdev label 0. ext2/3/4 share a magic and
+ * are told apart by their feature flags, as mke2fs sets them. Where the
+ * superblock has them, the UUID and label are read from the same buffer.
+ */
+#define FSPROBE_SIZE (256 * 1024)
+
+struct fsmagic {
+  const char* type;
+  size_t off;          /* of the magic */
+  const char* magic;
+  size_t len;
+  size_t uuid;         /* offset of the 16 byte UUID, or 0 */
+  size_t label;        /* offset of the label, or 0 */
+  size_t label_len;
+  int utf16;           /* label is UTF-16LE */
+};
+static const struct fsmagic fsmagic[] = {
+  { "xfs",      0x0,     "XFSB",             4,  0x20,    0x6c,    12,  0 },
+  { "squashfs", 0x0,     "hsqs",             4,  0,       0,       0,   0 },
+  { "ext4",     0x438,   "\x53\xef",         2,  0x468,   0x478,   16,  0 },
+  { "f2fs",     0x400,   "\x10\x20\xf5\xf2", 4,  0x46c,   0x47c,   512, 1 },
+  { "erofs",    0x400,   "\xe2\xe1\xf5\xe0", 4,  0x430,   0x440,   16,  0 },
+  { "btrfs",    0x10040, "_BHRfS_M",         8,  0x10020, 0x1012b, 256, 0 },
+  /* swap, for resume=; the signature ends the first page */
+  { "swap",     0xff6,   "SWAPSPACE2",       10, 0x40c,   0x41c,   16,  0 },
+  { "swap",     0xfff6,  "SWAPSPACE2",       10, 0x40c,   0x41c,   16,  0 }
+};
+
+#define ZFS_UBERBLOCK_RING  (128 * 1024) /* in vdev label 0 */
+#define ZFS_UBERBLOCK_MAGIC 0x00bab10cULL
+
+/* what fsprobe() found on a device */
+struct fsid {
+  const char* type;
+  char uuid[37];
+  char label[64];
+};
+
+static unsigned int fsprobe_le32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/* ext4 if features ext3 lacks are on, ext3 if it has a journal */
+static const char* fsprobe_ext(const unsigned char* sb) {
+  unsigned int compat = fsprobe_le32(sb + 0x5c);
+  unsigned int incompat = fsprobe_le32(sb + 0x60);
+  unsigned int ro_compat = fsprobe_le32(sb + 0x64);
+
+  /* beyond FILETYPE|RECOVER|JOURNAL_DEV|META_BG and SPARSE_SUPER|LARGE_FILE|BTREE_DIR */
+  if( (incompat & ~0x1eU) || (ro_compat & ~0x7U) ) return "ext4";
+  if( compat & 0x4 ) return "ext3";
+  return "ext2";
+}
+
+/* any uberblock in the ring, in either byte order */
+static int fsprobe_zfs(const unsigned char* buf, size_t len) {
+  unsigned long long magic;
+  size_t off;
+  int i;
+
+  for( off = ZFS_UBERBLOCK_RING; off + 8 <= len; off += 1024 ) {
+    for( magic = 0, i = 7; i >= 0; i-- ) magic = (magic << 8) | buf[off + i];
+    if( magic == ZFS_UBERBLOCK_MAGIC ) return 1;
+    for( magic = 0, i = 0; i < 8; i++ ) magic = (magic << 8) | buf[off + i];
+    if( magic == ZFS_UBERBLOCK_MAGIC ) return 1;
+  }
+  return 0;
+}
+
+/* format 16 bytes as a UUID; guid: the first three fields are little-endian */
+void fsprobe_uuid(const unsigned char* u, int guid, char* out) {
+  static const int be[16] = { 0,1,2,3, 4,5, 6,7, 8,9, 10,11,12,13,14,15 };
+  static const int le[16] = { 3,2,1,0, 5,4, 7,6, 8,9, 10,11,12,13,14,15 };
+  const int* order = guid ? le : be;
+  int i;
+
+  for( i=0; i<16; i++ ) {
+    out += snprintf(out, 3, "%02x", u[order[i]]);
+    if( (i == 3) || (i == 5) || (i == 7) || (i == 9) ) *out++ = '-';
+  }
+  *out = '\0';
+}
+
+/* copy a label of len bytes, keeping what is ASCII */
+void fsprobe_label(const unsigned char* p, size_t len, int utf16, char* out, size_t size) {
+  size_t i, n = 0;
+  int c;
+
+  for( i=0; (i < len) && (n + 1 < size); i += utf16 ? 2 : 1 ) {
+    c = utf16 ? (p[i] | (p[i+1] << 8)) : p[i];
+    if( c == 0 ) break;
+    out[n++] = (c < 0x80) ? c : '?';
+  }
+  while( (n > 0) && (out[n-1] == ' ') ) n--;
+  out[n] = '\0';
+}
+
+/* returns the filesystem type on dev, or NULL with errno set; if id is not
+ * NULL, it gets the type, UUID and label */
+const char* fsprobe(const char* dev, struct fsid* id) {
+  const struct fsmagic* m = NULL;
+  const char* type = NULL;
+  unsigned char* buf;
+  ssize_t len;
+  size_t i;
+  int fd;
+
+  if( id != NULL ) memset(id, 0, sizeof(*id));
+  fd = open(dev, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return NULL;
+  buf = malloc(FSPROBE_SIZE);
+  if( buf == NULL ) {
+    close(fd);
+    return NULL;
+  }
+  len = pread(fd, buf, FSPROBE_SIZE, 0);
+  close(fd);
+  if( len == -1 ) {
+    free(buf);
+    return NULL;
+  }
+  for( i=0; (type == NULL) && (i < sizeof(fsmagic)/sizeof(fsmagic[0])); i++ ) {
+    m = &fsmagic[i];
+    if( (m->off + m->len > (size_t) len) || (m->label + m->label_len > (size_t) len) ) continue;
+    if( memcmp(buf + m->off, m->magic, m->len) != 0 ) continue;
+    type = m->type;
+    if( strcmp(type, "ext4") == 0 ) type = fsprobe_ext(buf + 0x400);
+  }
+  if( type != NULL ) {
+    if( (id != NULL) && (m->uuid != 0) ) fsprobe_uuid(buf + m->uuid, 0, id->uuid);
+    if( (id != NULL) && (m->label != 0) ) fsprobe_label(buf + m->label, m->label_len, m->utf16, id->label, sizeof(id->label));
+  } else if( fsprobe_zfs(buf, len) ) type = "zfs";
+  free(buf);
+  if( id != NULL ) id->type = type;
+  if( type == NULL ) errno = EMEDIUMTYPE;
+  return type;
+}
+
+/*** blkid: UUID=, LABEL=, PARTUUID= and PARTLABEL= device names
+ *
+ * blkid_resolve() looks for the block device a tag names. Every device in
+ * /sys/class/block gets an entry in blkid_dev[], probed once for the boot:
+ * fsprobe() gives its UUID and label, and for a partition the GPT entry, or
+ * the MBR disk signature, of its disk gives PARTUUID and PARTLABEL. A tag
+ * has to name one device, so every device not probed yet is probed, on
+ * BLKID_THREADS threads; a later lookup, such as the one for resume=, finds
+ * them done. Two devices with the tag, like a disk and its clone, are an
+ * error. A device whose size has changed since, like a loop device that got
+ * attached, is probed again.
+ */
+#define BLKID_MAX     256
+#define BLKID_THREADS 8
+
+#define BLKID_NEW     0
+#define BLKID_PROBING 1
+#define BLKID_DONE    2
+
+struct blkid_dev {
+  char name[32];    /* in /sys/class/block */
+  char disk[32];    /* disk of a partition, or "" */
+  int partn;
+  int state;
+  unsigned long long size; /* in sectors, when probed */
+  struct fsid fs;
+  char partuuid[37];
+  char partlabel[40];
+};
+
+static struct blkid_dev blkid_dev[BLKID_MAX];
+static int blkid_ndev = 0;
+static pthread_mutex_t blkid_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blkid_probed = PTHREAD_COND_INITIALIZER; /* a probe ended */
+
+static const char* const blkid_tags[] = { "UUID=", "LABEL=", "PARTUUID=", "PARTLABEL=" };
+
+/* returns the tag index of spec, or -1 if it names no tag */
+int blkid_tag(const char* spec) {
+  int i;
+
+  for( i=0; i < (int) (sizeof(blkid_tags)/sizeof(blkid_tags[0])); i++ )
+    if( strncmp(spec, blkid_tags[i], strlen(blkid_tags[i])) == 0 ) return i;
+  return -1;
+}
+
+static int blkid_matches(struct blkid_dev* d, int tag, const char* val) {
+  switch( tag ) {
+    case 0: return (d->fs.uuid[0] != '\0') && (strcasecmp(d->fs.uuid, val) == 0);
+    case 1: return (d->fs.label[0] != '\0') && (strcmp(d->fs.label, val) == 0);
+    case 2: return (d->partuuid[0] != '\0') && (strcasecmp(d->partuuid, val) == 0);
+    case 3: return (d->partlabel[0] != '\0') && (strcmp(d->partlabel, val) == 0);
+  }
+  return 0;
+}
+
+static unsigned long long blkid_size(const char* name) {
+  char buf[64];
+  ssize_t n;
+  int fd;
+
+  snprintf(buf, sizeof(buf), "/sys/class/block/%s/size", name);
+  fd = open(buf, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return 0;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[(n > 0) ? n : 0] = '\0';
+  return strtoull(buf, NULL, 10);
+}
+
+/* blkid_lock held; returns the entry of a device, adding it if new */
+static struct blkid_dev* blkid_add(const char* name) {
+  struct blkid_dev* d;
+  char path[128];
+  char link[256];
+  char* p;
+  ssize_t n;
+  int i, fd;
+
+  for( i=0; i<blkid_ndev; i++ ) {
+    d = &blkid_dev[i];
+    if( strcmp(d->name, name) != 0 ) continue;
+    if( (d->state == BLKID_DONE) && (d->size != blkid_size(name)) ) d->state = BLKID_NEW;
+    return d;
+  }
+  if( (blkid_ndev == BLKID_MAX) || (strlen(name) >= sizeof(d->name)) ) return NULL;
+  d = &blkid_dev[blkid_ndev++];
+  memset(d, 0, sizeof(*d));
+  strcpy(d->name, name);
+  /* a partition has a partition number, and its disk is its parent in sysfs */
+  snprintf(path, sizeof(path), "/sys/class/block/%s/partition", name);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if( fd != -1 ) {
+    n = read(fd, link, sizeof(link) - 1);
+    close(fd);
+    d->partn = (n > 0) ? atoi(link) : 0;
+    snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+    n = readlink(path, link, sizeof(link) - 1);
+    if( n > 0 ) {
+      link[n] = '\0';
+      if( (p = strrchr(link, '/')) != NULL ) *p = '\0';
+      p = strrchr(link, '/');
+      snprintf(d->disk, sizeof(d->disk), "%.31s", (p == NULL) ? link : p + 1);
+    }
+  }
+  return d;
+}
+
+/* blockdev_match_fn that adds every device */
+static int blkid_add_blockdev(const char* devname, void* arg) {
+  if( blockdev_slow(devname) ) return 0;
+  pthread_mutex_lock(&blkid_lock);
+  blkid_add(devname);
+  pthread_mutex_unlock(&blkid_lock);
+  return 0;
+}
+
+/* PARTUUID and PARTLABEL of a partition, from the table of its disk */
+static void blkid_part(struct blkid_dev* d) {
+  unsigned char* buf;
+  unsigned char ent[128];
+  unsigned long long lba;
+  unsigned int lbs = 512, n, esz, sig;
+  char path[128];
+  ssize_t len;
+  int fd;
+
+  snprintf(path, sizeof(path), "/sys/class/block/%s/queue/logical_block_size", d->disk);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if( fd != -1 ) {
+    len = read(fd, path, sizeof(path) - 1);
+    close(fd);
+    if( len > 0 ) {
+      path[len] = '\0';
+      lbs = atoi(path);
+    }
+  }
+  if( (lbs < 512) || (lbs > 65536) ) return;
+  snprintf(path, sizeof(path), "/dev/%s", d->disk);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return;
+  buf = malloc(2 * lbs);
+  if( (buf != NULL) && (pread(fd, buf, 2 * lbs, 0) == 2 * lbs) ) {
+    if( memcmp(buf + lbs, "EFI PART", 8) == 0 ) {
+      lba = fsprobe_le32(buf + lbs + 72) | ((unsigned long long) fsprobe_le32(buf + lbs + 76) << 32);
+      n = fsprobe_le32(buf + lbs + 80);
+      esz = fsprobe_le32(buf + lbs + 84);
+      if( (d->partn > 0) && ((unsigned int) d->partn <= n) && (esz >= sizeof(ent)) &&
+          (pread(fd, ent, sizeof(ent), lba * lbs + (unsigned long long) (d->partn - 1) * esz) == sizeof(ent)) ) {
+        fsprobe_uuid(ent + 16, 1, d->partuuid);
+        fsprobe_label(ent + 56, 72, 1, d->partlabel, sizeof(d->partlabel));
+      }
+    } else if( (buf[510] == 0x55) && (buf[511] == 0xaa) ) {
+      sig = fsprobe_le32(buf + 440);
+      if( sig != 0 ) snprintf(d->partuuid, sizeof(d->partuuid), "%08x-%02x", sig, d->partn);
+    }
+  }
+  free(buf);
+  close(fd);
+}
+
+/* called and returns with blkid_lock held; probes a BLKID_NEW device */
+static void blkid_probe(struct blkid_dev* d) {
+  char path[64];
+
+  d->state = BLKID_PROBING;
+  pthread_mutex_unlock(&blkid_lock);
+
+  d->size = blkid_size(d->name);
+  snprintf(path, sizeof(path), "/dev/%s", d->name);
+  fsprobe(path, &d->fs);
+  d->partuuid[0] = d->partlabel[0] = '\0';
+  if( d->disk[0] != '\0' ) blkid_part(d);
+  pthread_mutex_lock(&blkid_lock);
+  d->state = BLKID_DONE;
+  pthread_cond_broadcast(&blkid_probed);
+}
+
+/* probes devices until none is new or in a probe */
+static void* blkid_worker(void* arg) {
+  int i;
+
+  pthread_mutex_lock(&blkid_lock);
+  for( ;; ) {
+    for( i=0; (i < blkid_ndev) && (blkid_dev[i].state != BLKID_NEW); i++ );
+    if( i < blkid_ndev ) {
+      blkid_probe(&blkid_dev[i]);
+      continue;
+    }
+    /* nothing left to probe here; a device may still be in a probe
+     * started by another lookup, such as that of a concurrent stage */
+    for( i=0; (i < blkid_ndev) && (blkid_dev[i].state != BLKID_PROBING); i++ );
+    if( i == blkid_ndev ) break;
+    pthread_cond_wait(&blkid_probed, &blkid_lock);
+  }
+  pthread_mutex_unlock(&blkid_lock);
+  return NULL;
+}
+
+/* looks for the device spec (TAG=value) names, probing new devices as
+ * needed; returns 0 and "/dev/<name>" in out, or -1 with errno ENODEV if
+ * none matches yet and ENOTUNIQ, logged, if more than one does */
+int blkid_resolve(const char* spec, char* out, size_t size) {
+  pthread_t th[BLKID_THREADS];
+  char names[256];
+  const char* val;
+  size_t len = 0;
+  int tag, i, n, nnew = 0, found = -1, nfound = 0;
+
+  tag = blkid_tag(spec);
+  if( tag < 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+  val = spec + strlen(blkid_tags[tag]);
+
+  blockdev_scan(blkid_add_blockdev, NULL);
+  pthread_mutex_lock(&blkid_lock);
+  for( i=0; i<blkid_ndev; i++ ) if( blkid_dev[i].state == BLKID_NEW ) nnew++;
+  pthread_mutex_unlock(&blkid_lock);
+  for( n=0; (n < BLKID_THREADS) && (n < nnew); n++ )
+    if( pthread_create(&th[n], NULL, blkid_worker, NULL) != 0 ) break;
+  if( n == 0 ) blkid_worker(NULL);
+  for( i=0; i<n; i++ ) pthread_join(th[i], NULL);
+
+  names[0] = '\0';
+  pthread_mutex_lock(&blkid_lock);
+  for( i=0; i<blkid_ndev; i++ ) {
+    if( (blkid_dev[i].state != BLKID_DONE) || !blkid_matches(&blkid_dev[i], tag, val) ) continue;
+    if( nfound++ == 0 ) found = i;
+    if( len < sizeof(names) ) len += snprintf(names + len, sizeof(names) - len, " /dev/%s", blkid_dev[i].name);
+  }
+  if( nfound == 1 ) snprintf(out, size, "/dev/%s", blkid_dev[found].name);
+  pthread_mutex_unlock(&blkid_lock);
+  if( nfound > 1 ) {
+    printk(KERN_ERR "%s: %d devices match:%s; give the device itself.\n", spec, nfound, names);
+    errno = ENOTUNIQ;
+    return -1;
+  }
+  if( nfound == 0 ) {
+    errno = ENODEV;
+    return -1;
+  }
+  return 0;
+}
+
+/* blockdev_match_fn for blockdev_wait(): arg is the TAG=value */
+int blkid_match_blockdev(const char* devname, void* arg) {
+  const char* spec = arg;
+  struct blkid_dev* d;
+  int tag = blkid_tag(spec);
+  int ret;
+
+  if( blockdev_slow(devname) ) return 0;
+  pthread_mutex_lock(&blkid_lock);
+  d = blkid_add(devname);
+  /* a device another thread is probing is checked once that probe ends */
+  while( (d != NULL) && (d->state != BLKID_DONE) ) {
+    if( d->state == BLKID_NEW ) blkid_probe(d);
+    else pthread_cond_wait(&blkid_probed, &blkid_lock);
+  }
+  ret = (d != NULL) && blkid_matches(d, tag, spec + strlen(blkid_tags[tag]));
+  pthread_mutex_unlock(&blkid_lock);
+  return ret;
+}
+
+/*** mnt: mount engine on the new mount API, with mount(2) fallback
+ *
+ * mnt_prepare() builds a superblock with fsopen()/fsconfig() and turns it into
+ * a detached mount with fsmount(); nothing is visible in the tree until
+ * mnt_attach() puts it in place with move_mount(). That lets the root
+ * filesystem be set up while other stages still work on the early mounts.
+ * If the filesystem refuses the configuration, the messages it left in the
+ * fs context log are printed, not just strerror(errno). mnt_move() moves an
+ * attached mount with move_mount().
+ *
+ * Kernels before 5.2 return ENOSYS; from then on every call uses mount(2),
+ * with the same flags and data string.
+ */
+#ifndef SYS_open_tree
+#define SYS_open_tree  428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef SYS_fsopen
+#define SYS_fsopen     430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig   431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount    432
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY      0x00000001
+#define MOUNT_ATTR_NOSUID      0x00000002
+#define MOUNT_ATTR_NODEV       0x00000004
+#define MOUNT_ATTR_NOEXEC      0x00000008
+#define MOUNT_ATTR_RELATIME    0x00000000
+#define MOUNT_ATTR_NOATIME     0x00000010
+#define MOUNT_ATTR_STRICTATIME 0x00000020
+#define MOUNT_ATTR_NODIRATIME  0x00000080
+#endif
+#define MNT_FSCONFIG_SET_FLAG   0
+#define MNT_FSCONFIG_SET_STRING 1
+#define MNT_FSCONFIG_CMD_CREATE 6
+
+static int mnt_newapi = 1; /* cleared on the first ENOSYS */
+
+/* print and drain the fs context log: lines of "e ", "w " or "i " + text */
+static void mnt_fslog(int fsfd, const char* what) {
+  char buf[512];
+  ssize_t n;
+
+  while( (n = read(fsfd, buf, sizeof(buf)-1)) > 0 ) {
+    buf[n] = '\0';
+    if( (n > 2) && (buf[0] == 'e') ) printk(KERN_ERR "%s: %s\n", what, buf + 2);
+    else if( (n > 2) && (buf[0] == 'w') ) printk(KERN_WARNING "%s: %s\n", what, buf + 2);
+    else printk("%s: %s\n", what, (n > 2) ? buf + 2 : buf);
+  }
+}
+
+static int mnt_fsconfig(int fsfd, const char* key, const char* value) {
+  if( value == NULL ) return syscall(SYS_fsconfig, fsfd, MNT_FSCONFIG_SET_FLAG, key, NULL, 0);
+  return syscall(SYS_fsconfig, fsfd, MNT_FSCONFIG_SET_STRING, key, value, 0);
+}
+
+/* a detached mount fd for a new fstype superblock from source, or -1;
+ * flags are MS_* as for mount(2), data a comma-separated option string */
+int mnt_prepare(const char* source, const char* fstype, unsigned long flags, const char* data) {
+  static const struct { unsigned long ms; const char* key; } sbflag[] = {
+    { MS_RDONLY, "ro" }, { MS_SYNCHRONOUS, "sync" }, { MS_DIRSYNC, "dirsync" },
+    { MS_LAZYTIME, "lazytime" }, { MS_MANDLOCK, "mand" }
+  };
+  static const struct { unsigned long ms; unsigned int attr; } mntattr[] = {
+    { MS_RDONLY, MOUNT_ATTR_RDONLY }, { MS_NOSUID, MOUNT_ATTR_NOSUID }, { MS_NODEV, MOUNT_ATTR_NODEV },
+    { MS_NOEXEC, MOUNT_ATTR_NOEXEC }, { MS_NOATIME, MOUNT_ATTR_NOATIME },
+    { MS_STRICTATIME, MOUNT_ATTR_STRICTATIME }, { MS_NODIRATIME, MOUNT_ATTR_NODIRATIME }
+  };
+  char opts[4096];
+  char* opt;
+  char* next;
+  char* val;
+  unsigned int attr = 0;
+  int fsfd, mfd, saved_errno;
+  size_t i;
+
+  if( !mnt_newapi ) {
+    errno = ENOSYS;
+    return -1;
+  }
+  fsfd = syscall(SYS_fsopen, fstype, FSOPEN_CLOEXEC);
+  if( fsfd == -1 ) {
+    if( errno == ENOSYS ) mnt_newapi = 0;
+    return -1;
+  }
+  if( (source != NULL) && (mnt_fsconfig(fsfd, "source", source) != 0) ) goto fail;
+  for( i=0; i<sizeof(sbflag)/sizeof(sbflag[0]); i++ )
+    if( (flags & sbflag[i].ms) && (mnt_fsconfig(fsfd, sbflag[i].key, NULL) != 0) ) goto fail;
+  if( (data != NULL) && (*data != '\0') ) {
+    if( strlen(data) >= sizeof(opts) ) {
+      errno = E2BIG;
+      goto fail;
+    }
+    strcpy(opts, data);
+    for( opt = opts; opt != NULL; opt = next ) {
+      next = strchr(opt, ',');
+      if( next != NULL ) *next++ = '\0';
+      if( *opt == '\0' ) continue;
+      val = strchr(opt, '=');
+      if( val != NULL ) *val++ = '\0';
+      if( mnt_fsconfig(fsfd, opt, val) != 0 ) goto fail;
+    }
+  }
+  if( syscall(SYS_fsconfig, fsfd, MNT_FSCONFIG_CMD_CREATE, NULL, NULL, 0) != 0 ) goto fail;
+  for( i=0; i<sizeof(mntattr)/sizeof(mntattr[0]); i++ )
+    if( flags & mntattr[i].ms ) attr |= mntattr[i].attr;
+  mfd = syscall(SYS_fsmount, fsfd, FSMOUNT_CLOEXEC, attr);
+  if( mfd == -1 ) goto fail;
+  mnt_fslog(fsfd, fstype);
+  close(fsfd);
+  return mfd;
+
+fail:
+  saved_errno = errno;
+  mnt_fslog(fsfd, fstype);
+  close(fsfd);
+  errno = saved_errno;
+  return -1;
+}
+
+/* attach a detached mount at target; closes mfd */
+int mnt_attach(int mfd, const char* target) {
+  int ret, saved_errno;
+
+  ret = syscall(SYS_move_mount, mfd, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH);
+  saved_errno = errno;
+  close(mfd);
+  errno = saved_errno;
+  return ret;
+}
+
+/* like mount(2) for a new mount */
+int mnt_mount(const char* source, const char* target, const char* fstype, unsigned long flags, const char* data) {
+  int mfd;
+
+  mfd = mnt_prepare(source, fstype, flags, data);
+  if( mfd != -1 ) return mnt_attach(mfd, target);
+  if( errno != ENOSYS ) return -1;
+  return mount(source, target, fstype, flags, data);
+}
+
+/* like mount --move from to */
+int mnt_move(const char* from, const char* to) {
+  if( mnt_newapi ) {
+    if( syscall(SYS_move_mount, AT_FDCWD, from, AT_FDCWD, to, 0) == 0 ) return 0;
+    if( errno != ENOSYS ) return -1;
+    mnt_newapi = 0;
+  }
+  return mount(from, to, NULL, MS_MOVE, NULL);
+}
+
+/* mount(8) options that are MS_* flags; the others are passed on as fs data */
+static const struct { const char* name; unsigned long set; unsigned long clear; } mnt_flag[] = {
+  { "defaults", 0, 0 },
+  { "ro", MS_RDONLY, 0 }, { "rw", 0, MS_RDONLY },
+  { "sync", MS_SYNCHRONOUS, 0 }, { "async", 0, MS_SYNCHRONOUS },
+  { "dirsync", MS_DIRSYNC, 0 },
+  { "mand", MS_MANDLOCK, 0 }, { "nomand", 0, MS_MANDLOCK },
+  { "atime", 0, MS_NOATIME }, { "noatime", MS_NOATIME, 0 },
+  { "diratime", 0, MS_NODIRATIME }, { "nodiratime", MS_NODIRATIME, 0 },
+  { "relatime", MS_RELATIME, MS_NOATIME | MS_STRICTATIME }, { "norelatime", 0, MS_RELATIME },
+  { "strictatime", MS_STRICTATIME, MS_NOATIME | MS_RELATIME }, { "nostrictatime", 0, MS_STRICTATIME },
+  { "lazytime", MS_LAZYTIME, 0 }, { "nolazytime", 0, MS_LAZYTIME },
+  { "suid", 0, MS_NOSUID }, { "nosuid", MS_NOSUID, 0 },
+  { "dev", 0, MS_NODEV }, { "nodev", MS_NODEV, 0 },
+  { "exec", 0, MS_NOEXEC }, { "noexec", MS_NOEXEC, 0 },
+  { "silent", MS_SILENT, 0 }, { "loud", 0, MS_SILENT }
+};
+
+/* mount(8) options that are not for a new mount of a filesystem */
+static const char* const mnt_notflag[] = {
+  "remount", "bind", "rbind", "move", "auto", "noauto", "user", "nouser", "users",
+  "owner", "group", "nofail", "_netdev"
+};
+
+/* split a mount(8) option string: MS_* flags are set in or cleared from
+ * *flags, other options are appended to data (size bytes, comma-separated).
+ * Returns 0, or -1 with errno EINVAL for an option that is not for a
+ * filesystem mount, or E2BIG when data is full. */
+int mnt_parse_opts(const char* opts, unsigned long* flags, char* data, size_t size) {
+  const char* opt;
+  size_t len, used = strlen(data), i;
+
+  for( opt = opts; *opt != '\0'; opt += len + (opt[len] == ',') ) {
+    len = strcspn(opt, ",");
+    if( len == 0 ) continue;
+    for( i=0; i<sizeof(mnt_flag)/sizeof(mnt_flag[0]); i++ )
+      if( (strlen(mnt_flag[i].name) == len) && (strncmp(opt, mnt_flag[i].name, len) == 0) ) break;
+    if( i < sizeof(mnt_flag)/sizeof(mnt_flag[0]) ) {
+      *flags = (*flags & ~mnt_flag[i].clear) | mnt_flag[i].set;
+      continue;
+    }
+    for( i=0; i<sizeof(mnt_notflag)/sizeof(mnt_notflag[0]); i++ )
+      if( (strlen(mnt_notflag[i]) == len) && (strncmp(opt, mnt_notflag[i], len) == 0) ) break;
+    if( (i < sizeof(mnt_notflag)/sizeof(mnt_notflag[0])) || (strncmp(opt, "x-", 2) == 0) ) {
+      printk(KERN_ERR "%.*s: not an option for mounting a filesystem.\n", (int) len, opt);
+      errno = EINVAL;
+      return -1;
+    }
+    if( used + (used > 0) + len + 1 > size ) {
+      errno = E2BIG;
+      return -1;
+    }
+    if( used > 0 ) data[used++] = ',';
+    memcpy(data + used, opt, len);
+    used += len;
+    data[used] = '\0';
+  }
+  return 0;
+}
+
+/* is something already mounted on path? */
+int mnt_is_mountpoint(const char* path) {
+  struct stat st, parent;
+  char up[256];
+
+  snprintf(up, sizeof(up), "%s/..", path);
+  if( (stat(path, &st) == -1) || (stat(up, &parent) == -1) ) return 0;
+  return st.st_dev != parent.st_dev;
+}
+
+/*** loop: attach an image file to a loop device
+ *
+ * loop_attach() takes a free device from /dev/loop-control and sets it up
+ * in one LOOP_CONFIGURE call (Linux 5.8), read-only and with direct I/O so
+ * the image is not cached twice, once as the file and once as the device.
+ * Older kernels get LOOP_SET_FD, LOOP_SET_STATUS64 and LOOP_SET_DIRECT_IO.
+ * The device is set to autoclear: it comes apart once the returned fd is
+ * closed and the filesystem on it is unmounted.
+ */
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config { __u32 fd; __u32 block_size; struct loop_info64 info; __u64 __reserved[8]; };
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+/* an fd on the loop device now backed by file, or -1; its name goes to dev */
+int loop_attach(const char* file, char* dev, size_t size) {
+  struct loop_config lc;
+  int ffd, ctl, lfd = -1, n, tries, saved_errno;
+
+  ffd = open(file, O_RDONLY | O_CLOEXEC);
+  if( ffd == -1 ) return -1;
+  ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  if( ctl == -1 ) goto fail;
+
+  memset(&lc, 0, sizeof(lc));
+  lc.fd = ffd;
+  lc.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+  strncpy((char*) lc.info.lo_file_name, file, LO_NAME_SIZE - 1);
+  /* another program may take the free device first */
+  for( tries = 0; tries < 8; tries++ ) {
+    n = ioctl(ctl, LOOP_CTL_GET_FREE);
+    if( n < 0 ) break;
+    snprintf(dev, size, "/dev/loop%d", n);
+    lfd = open(dev, O_RDONLY | O_CLOEXEC);
+    if( lfd == -1 ) break;
+    if( ioctl(lfd, LOOP_CONFIGURE, &lc) == 0 ) break;
+    if( (errno == EINVAL) || (errno == ENOTTY) ) {
+      /* before 5.8; the file's O_RDONLY makes the device read-only */
+      if( ioctl(lfd, LOOP_SET_FD, ffd) == 0 ) {
+        lc.info.lo_flags &= ~(LO_FLAGS_READ_ONLY | LO_FLAGS_DIRECT_IO);
+        if( ioctl(lfd, LOOP_SET_STATUS64, &lc.info) == 0 ) {
+          ioctl(lfd, LOOP_SET_DIRECT_IO, 1UL);
+          break;
+        }
+        saved_errno = errno;
+        ioctl(lfd, LOOP_CLR_FD, 0);
+        errno = saved_errno;
+      }
+    }
+    saved_errno = errno;
+    close(lfd);
+    lfd = -1;
+    errno = saved_errno;
+    if( errno != EBUSY ) break;
+  }
+
+fail:
+  saved_errno = errno;
+  if( ctl != -1 ) close(ctl);
+  close(ffd);
+  errno = saved_errno;
+  return lfd;
+}
+
+/* is direct I/O in use on the loop device? */
+int loop_direct_io(int lfd) {
+  struct loop_info64 info;
+
+  if( ioctl(lfd, LOOP_GET_STATUS64, &info) != 0 ) return 0;
+  return (info.lo_flags & LO_FLAGS_DIRECT_IO) != 0;
+}
+
+/*** reclaim: empty the initramfs after the root switch
+ *
+ * As in util-linux switch_root, the old root is opened before the switch and
+ * emptied through that fd once the new root is in place, using openat(),
+ * fdopendir() and unlinkat(), so no path into the old tree is needed. The
+ * walk never crosses into another filesystem (st_dev), and reclaim_open()
+ * refuses anything but a ramfs or tmpfs root.
+ */
+struct reclaim_stats { unsigned long long bytes; unsigned long files; unsigned long dirs; unsigned long errors; };
+
+/* returns an fd on the initramfs root, or -1 if it must not be emptied */
+int reclaim_open(void) {
+  struct statfs sfs;
+  int fd;
+
+  fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if( fd == -1 ) return -1;
+  if( (fstatfs(fd, &sfs) != 0) || ((sfs.f_type != RAMFS_MAGIC) && (sfs.f_type != TMPFS_MAGIC)) ) {
+    printk(KERN_WARNING "reclaim: / is not ramfs or tmpfs; leaving it alone.\n");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void reclaim_dir(int dfd, dev_t dev, struct reclaim_stats* rs) {
+  struct stat sb;
+  struct dirent* de;
+  DIR* dir;
+  int fd;
+
+  dir = fdopendir(dfd);
+  if( dir == NULL ) {
+    close(dfd);
+    rs->errors++;
+    return;
+  }
+  while( (de = readdir(dir)) != NULL ) {
+    if( (strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0) ) continue;
+    if( fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0 ) {
+      rs->errors++;
+      continue;
+    }
+    /* a mount point: leave it and everything under it */
+    if( sb.st_dev != dev ) continue;
+    if( S_ISDIR(sb.st_mode) ) {
+      fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if( fd == -1 ) {
+        rs->errors++;
+        continue;
+      }
+      reclaim_dir(fd, dev, rs);
+      if( unlinkat(dirfd(dir), de->d_name, AT_REMOVEDIR) == 0 ) rs->dirs++;
+      else rs->errors++;
+    } else {
+      if( unlinkat(dirfd(dir), de->d_name, 0) != 0 ) {
+        rs->errors++;
+        continue;
+      }
+      rs->files++;
+      /* data goes away with the last link; ramfs leaves st_blocks at 0 */
+      if( sb.st_nlink == 1 )
+        rs->bytes += sb.st_blocks ? (unsigned long long) sb.st_blocks * 512 : (unsigned long long) sb.st_size;
+    }
+  }
+  closedir(dir);
+}
+
+/* empty the old root behind rootfd, which is closed */
+void reclaim_tree(int rootfd, struct reclaim_stats* rs) {
+  struct stat oldsb, newsb;
+
+  memset(rs, 0, sizeof(*rs));
+  if( (fstat(rootfd, &oldsb) != 0) || (stat("/", &newsb) != 0) || (oldsb.st_dev == newsb.st_dev) ) {
+    printk(KERN_WARNING "reclaim: old root is still /; not deleting anything.\n");
+    close(rootfd);
+    return;
+  }
+  reclaim_dir(rootfd, oldsb.st_dev, rs);
+}
+
+/*** dag: dependency graph run by a fixed pool of threads
+ *
+ * Each node names the nodes it depends on by index. dag_run() starts
+ * DAG_THREADS workers (the calling thread is one of them); a worker takes the
+ * lowest-index node whose dependencies are all done. A node whose run()
+ * returns non-zero has failed, and every node that depends on it, directly or
+ * not, is skipped; independent nodes still run.
+ *
+ * Log lines of a node are captured and released in node order: the lowest
+ * node whose log has not been released yet logs straight to kmsg, so a long
+ * wait there stays visible, and the lines of nodes after it follow once it
+ * has finished. A node may itself call dag_run(); the lines of the inner
+ * nodes then end up in the log of the calling node.
+ */
+#define DAG_THREADS 4
+
+#define DAG_UNTIMED 1 /* flags: leave the node out of the boot timeline */
+
+#define DAG_WAITING 0
+#define DAG_RUNNING 1
+#define DAG_DONE    2
+#define DAG_FAILED  3
+#define DAG_SKIPPED 4
+
+#define NODEPS    NULL, 0
+#define DEPS(...) (const int[]){ __VA_ARGS__ }, sizeof((const int[]){ __VA_ARGS__ })/sizeof(int)
+
+struct dag_node {
+  const char* name;
+  int (*run)(void* arg);
+  void* arg;
+  const int* deps;
+  int ndeps;
+  int flags;
+  /* set by dag_run() */
+  int state;
+  int result;
+  struct klog_capture log;
+};
+
+struct dag {
+  struct dag_node* node;
+  int n;
+  int unfinished;
+  int running;
+  int released; /* nodes before this one have had their log released */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* g->lock held */
+static void dag_release_logs(struct dag* g) {
+  while( (g->released < g->n) && (g->node[g->released].state >= DAG_DONE) )
+    klog_capture_release(&g->node[g->released++].log);
+  if( g->released < g->n ) klog_capture_release(&g->node[g->released].log);
+}
+
+/* g->lock held; returns a node ready to run, or NULL */
+static struct dag_node* dag_next(struct dag* g) {
+  struct dag_node* nd;
+  struct klog_capture* outer = klog_cap;
+  int i, j, dep, ready, changed;
+
+  do {
+    changed = 0;
+    for( i=0; i<g->n; i++ ) {
+      nd = &g->node[i];
+      if( nd->state != DAG_WAITING ) continue;
+      ready = 1;
+      for( j=0; (j < nd->ndeps) && (ready >= 0); j++ ) {
+        dep = g->node[nd->deps[j]].state;
+        if( (dep == DAG_FAILED) || (dep == DAG_SKIPPED) ) ready = -1;
+        else if( dep != DAG_DONE ) ready = 0;
+      }
+      if( ready == 1 ) return nd;
+      if( ready == -1 ) {
+        klog_capture(&nd->log);
+        printk(KERN_WARNING "%s: skipped, a dependency failed.\n", nd->name);
+        klog_capture(outer);
+        nd->state = DAG_SKIPPED;
+        g->unfinished--;
+        changed = 1;
+      }
+    }
+  } while( changed );
+  return NULL;
+}
+
+static void* dag_worker(void* arg) {
+  struct dag* g = arg;
+  struct dag_node* nd;
+  struct klog_capture* outer = klog_cap;
+  int i, result, tl;
+
+  pthread_mutex_lock(&g->lock);
+  while( g->unfinished > 0 ) {
+    nd = dag_next(g);
+    dag_release_logs(g);
+    if( nd == NULL ) {
+      if( g->running == 0 ) {
+        /* nothing runs and nothing can: the remaining nodes form a cycle */
+        for( i=0; i<g->n; i++ ) {
+          if( g->node[i].state != DAG_WAITING ) continue;
+          printk(KERN_ERR "%s: dependency cycle.\n", g->node[i].name);
+          g->node[i].state = DAG_FAILED;
+          g->node[i].result = EX_SOFTWARE;
+          g->unfinished--;
+        }
+        dag_release_logs(g);
+        pthread_cond_broadcast(&g->cond);
+      } else pthread_cond_wait(&g->cond, &g->lock);
+      continue;
+    }
+    nd->state = DAG_RUNNING;
+    g->running++;
+    pthread_mutex_unlock(&g->lock);
+
+    klog_capture(&nd->log);
+    tl = (nd->flags & DAG_UNTIMED) ? -1 : timeline_begin(nd->name);
+    result = nd->run(nd->arg);
+    if( result == 0 ) timeline_end(tl);
+    else printk(KERN_ERR "%s: failed.\n", nd->name);
+    klog_capture(outer);
+
+    pthread_mutex_lock(&g->lock);
+    nd->result = result;
+    nd->state = (result == 0) ? DAG_DONE : DAG_FAILED;
+    g->running--;
+    g->unfinished--;
+    dag_release_logs(g);
+    pthread_cond_broadcast(&g->cond);
+  }
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+/* returns 0, or the result of the first failed node */
+int dag_run(struct dag_node* node, int n, int nthreads) {
+  pthread_t tid[DAG_THREADS];
+  struct dag g;
+  int i, started = 0;
+
+  g.node = node;
+  g.n = n;
+  g.unfinished = n;
+  g.running = 0;
+  g.released = 0;
+  pthread_mutex_init(&g.lock, NULL);
+  pthread_cond_init(&g.cond, NULL);
+  for( i=0; i<n; i++ ) {
+    node[i].state = DAG_WAITING;
+    node[i].result = 0;
+    memset(&node[i].log, 0, sizeof(node[i].log));
+    node[i].log.parent = klog_cap;
+  }
+
+  if( nthreads > DAG_THREADS ) nthreads = DAG_THREADS;
+  for( i=1; i<nthreads; i++ )
+    if( pthread_create(&tid[started], NULL, dag_worker, &g) == 0 ) started++;
+  dag_worker(&g);
+  for( i=0; i<started; i++ ) pthread_join(tid[i], NULL);
+  pthread_mutex_destroy(&g.lock);
+  pthread_cond_destroy(&g.cond);
+
+  for( i=0; i<n; i++ )
+    if( node[i].state == DAG_FAILED ) return node[i].result;
+  return 0;
+}
+
+/*** kernel parameters
+ *
+ * note about environ, argv, and kernel cmdline for init:
+ *   environ is not defined for init
+ *   only argv[0] is set for init
+ *   kernel command line parameters are accessed
+ *   at /proc/cmdline
+ *
+ * param[] is the registry of parameters this program understands, indexed by
+ * the i* enum below; to add one, add a row and an enum entry in the same
+ * place. /proc/cmdline is read to EOF and split in one pass with the kernel's
+ * own rules: whitespace separates parameters, double quotes may enclose a
+ * value or a whole parameter (param="a b" or "param=a b"), and "--" ends the
+ * kernel's part of the line. Each name is looked up in param_hash[], a
+ * collision-free table that param_hash_init() builds from the registry, so a
+ * lookup costs one hash and one compare however long the registry gets. As
+ * in the kernel, '-' and '_' in names are the same, and the last occurrence
+ * of a parameter wins. A PARAM_FLAG parameter may be given without a value.
+ */
+#define PARAM_FLAG 2 /* req field: may appear without =value */
+#define PARAM_BLANK(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\n'))
+
+struct nv { char* n; char* v; int req; int src; char* def; };
+static struct nv param[] = {
+  { "root",          NULL, PARAM_REQ_YES, PARAM_SRC_DEFAULT, "<missing required param>" },
+  { "rootfstype",    NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "auto" },
+  { "mountopt",      NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "ro" },
+  { "rootflags",     NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "init",          NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "/sbin/init" },
+  { "runlevel",      NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "3" },
+  { "console",       NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "console" },
+  { "init_loglevel", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "8" },
+  { "rootwait",      NULL, PARAM_FLAG   , PARAM_SRC_DEFAULT, "off" },
+  { "rootdelay",     NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "0" },
+  { "rootimage",     NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "rootimagefstype", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "auto" },
+  { "rootoverlay",   NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "resume",        NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "resume_offset", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "resumewait",    NULL, PARAM_FLAG   , PARAM_SRC_DEFAULT, "off" },
+  { "zram",          NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "zram_tmp",      NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "boottune",      NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "boottune_restore", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "modules_load",  NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "bootreadahead", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "bootreadahead_time", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, "30" }
+#if defined(INCLUDE_ZPOOL_IMPORT)
+  ,
+  { "zpool_import_name",    NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "zpool_import_guid",    NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "zpool_import_newname", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "zpool_import_force",   NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "zpool_import_dir",     NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "zpool_import_devices", NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL },
+  { "zfs_mount_children",   NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT, NULL }
+#endif
+};
+enum {
+	iroot,
+	irootfstype,
+	imountopt,
+	irootflags,
+	iinit,
+	irunlevel,
+	iconsole,
+	iinit_loglevel,
+	irootwait,
+	irootdelay,
+	irootimage,
+	irootimagefstype,
+	irootoverlay,
+	iresume,
+	iresume_offset,
+	iresumewait,
+	izram,
+	izram_tmp,
+	iboottune,
+	iboottune_restore,
+	imodules_load,
+	ibootreadahead,
+	ibootreadahead_time,
+#if defined(INCLUDE_ZPOOL_IMPORT)
+	izpool_import_name,
+	izpool_import_guid,
+	izpool_import_newname,
+	izpool_import_force,
+	izpool_import_dir,
+	izpool_import_devices,
+	izfs_mount_children,
+#endif
+	ilastparam
+};
+
+/* where the kernel command line is read from; a test build may point
+ * this at a file with -DPROC_CMDLINE='"/cmdline"' */
+#ifndef PROC_CMDLINE
+#define PROC_CMDLINE "/proc/cmdline"
+#endif
+
+/* kernel command line, as read from PROC_CMDLINE and split in place */
+static char* cmdline;
+
+/* its <module>.<param>[=<value>] parameters, for stage_modules */
+#define MODPARAM_MAX 256
+static struct { char* name; char* val; } modparam[MODPARAM_MAX];
+static int nmodparam;
+
+#define PARAM_HASH_SIZE 256 /* power of two, well above ilastparam */
+static unsigned char param_hash[PARAM_HASH_SIZE]; /* param index + 1, 0 if empty */
+static unsigned int param_hash_seed;
+
+/* FNV-1a over the name up to '\0' or '=', with '-' read as '_' */
+static unsigned int param_hash_name(const char* name, unsigned int seed) {
+  unsigned int h = 2166136261u ^ seed;
+
+  for( ; (*name != '\0') && (*name != '='); name++ ) {
+    h ^= (*name == '-') ? '_' : (unsigned char) *name;
+    h *= 16777619u;
+  }
+  return h & (PARAM_HASH_SIZE - 1);
+}
+
+/* find a seed that gives every registered name its own slot */
+static int param_hash_init(void) {
+  unsigned int seed, h;
+  int i;
+
+  for( seed = 0; seed < 4096; seed++ ) {
+    memset(param_hash, 0, sizeof(param_hash));
+    for( i=0; i<ilastparam; i++ ) {
+      h = param_hash_name(param[i].n, seed);
+      if( param_hash[h] != 0 ) break;
+      param_hash[h] = i + 1;
+    }
+    if( i == ilastparam ) {
+      param_hash_seed = seed;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int param_name_eq(const char* a, const char* b) {
+  for( ; *a && *b; a++, b++ )
+    if( (*a != *b) && !(((*a == '-') || (*a == '_')) && ((*b == '-') || (*b == '_'))) ) return 0;
+  return *a == *b;
+}
+
+/* returns the registry index of name, or -1 */
+int param_lookup(const char* name) {
+  int i = param_hash[param_hash_name(name, param_hash_seed)];
+
+  if( (i == 0) || !param_name_eq(param[i-1].n, name) ) return -1;
+  return i - 1;
+}
+
+/* split off the next parameter of args, like the kernel's next_arg();
+ * returns the rest of the line with leading blanks skipped */
+static char* param_next(char* args, char** name, char** val) {
+  size_t i, equals = 0;
+  int in_quote = 0, quoted = 0;
+
+  if( *args == '"' ) {
+    args++;
+    in_quote = quoted = 1;
+  }
+  for( i=0; args[i] != '\0'; i++ ) {
+    if( PARAM_BLANK(args[i]) && !in_quote ) break;
+    if( (equals == 0) && (args[i] == '=') ) equals = i;
+    if( args[i] == '"' ) in_quote = !in_quote;
+  }
+  *name = args;
+  if( equals == 0 ) *val = NULL;
+  else {
+    args[equals] = '\0';
+    *val = args + equals + 1;
+    /* don't include quotes in value */
+    if( **val == '"' ) {
+      (*val)++;
+      if( args[i-1] == '"' ) args[i-1] = '\0';
+    }
+  }
+  if( quoted && (i > 0) && (args[i-1] == '"') ) args[i-1] = '\0';
+  if( args[i] != '\0' ) {
+    args[i] = '\0';
+    args += i + 1;
+  } else args += i;
+  while( PARAM_BLANK(*args) ) args++;
+  return args;
+}
+
+/* seconds with up to three decimals, as in rootwait=2.5, in ms; -1 if
+ * s is not that */
+static long param_ms(const char* s) {
+  long ms = 0, unit = 1000;
+
+  if( (*s < '0') || (*s > '9') ) return -1;
+  for( ; (*s >= '0') && (*s <= '9'); s++ ) {
+    if( ms > 100000000L ) return -1;
+    ms = ms * 10 + (*s - '0') * unit;
+  }
+  if( *s == '.' )
+    for( s++; (*s >= '0') && (*s <= '9'); s++ ) ms += (*s - '0') * (unit /= 10);
+  return (*s == '\0') ? ms : -1;
+}
+
+/* read a whole /proc file, whose size stat() does not know; returns a
+ * malloc'd NUL-terminated buffer or NULL */
+static char* read_proc_file(const char* path, size_t* size) {
+  size_t len = 0, cap = 4096;
+  ssize_t n;
+  char* buf;
+  char* nbuf;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return NULL;
+  buf = malloc(cap);
+  while( buf != NULL ) {
+    if( len + 1 == cap ) {
+      nbuf = realloc(buf, cap *= 2);
+      if( nbuf == NULL ) {
+        free(buf);
+        buf = NULL;
+        errno = ENOMEM;
+        break;
+      }
+      buf = nbuf;
+    }
+    n = read(fd, buf + len, cap - len - 1);
+    if( n > 0 ) len += n;
+    else if( (n == -1) && (errno == EINTR) ) continue;
+    else if( n == 0 ) break;
+    else {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  close(fd);
+  if( buf == NULL ) return NULL;
+  buf[len] = '\0';
+  if( size != NULL ) *size = len;
+  return buf;
+}
+
+/*** warm: pull the real init and its libraries into the page cache
+ *
+ * Once the init program is known to be there, warm_start() follows its ELF
+ * headers: the PT_INTERP loader, the DT_NEEDED libraries, and theirs, looked
+ * up like ld.so does in DT_RUNPATH/DT_RPATH, the directories of the new
+ * root's /etc/ld.so.conf and the default ones. Each file found gets
+ * POSIX_FADV_WILLNEED on one of WARM_THREADS threads, which go on while the
+ * root is switched; warm_wait() joins them before execl(). Paths are
+ * resolved under the new root with openat2(RESOLVE_IN_ROOT), so absolute
+ * symlinks such as the loader's stay inside it.
+ */
+#define WARM_THREADS 4
+#define WARM_MAX     64 /* files */
+#define WARM_DIRS    32 /* library directories */
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+#ifndef RESOLVE_IN_ROOT
+#define RESOLVE_IN_ROOT 0x10
+#endif
+struct warm_how { unsigned long long flags, mode, resolve; };
+
+static struct {
+  int rootfd;
+  int resolve;                /* openat2() works */
+  char* file[WARM_MAX];
+  int nfile;
+  int next;                   /* next file to warm */
+  int busy;                   /* threads warming a file */
+  char* dir[WARM_DIRS];
+  int ndir;
+  unsigned long long bytes;
+  pthread_t th[WARM_THREADS];
+  int nth;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} warm = { -1, 1, {0}, 0, 0, 0, {0}, 0, 0, {0}, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* open an absolute path of the new root */
+static int warm_open(const char* path) {
+  struct warm_how how = { O_RDONLY | O_CLOEXEC, 0, RESOLVE_IN_ROOT };
+  int fd;
+
+  if( warm.resolve ) {
+    fd = syscall(SYS_openat2, warm.rootfd, path, &how, sizeof(how));
+    if( (fd != -1) || (errno != ENOSYS) ) return fd;
+    warm.resolve = 0;
+  }
+  while( *path == '/' ) path++;
+  return openat(warm.rootfd, path, O_RDONLY | O_CLOEXEC);
+}
+
+/* warm.lock held */
+static void warm_add(const char* path) {
+  int i;
+
+  for( i=0; i<warm.nfile; i++ ) if( strcmp(warm.file[i], path) == 0 ) return;
+  if( warm.nfile == WARM_MAX ) return;
+  warm.file[warm.nfile] = strdup(path);
+  if( warm.file[warm.nfile] != NULL ) warm.nfile++;
+  pthread_cond_broadcast(&warm.cond);
+}
+
+/* warm.lock held */
+static void warm_add_dir(const char* dir) {
+  int i;
+
+  if( (dir[0] != '/') || (warm.ndir == WARM_DIRS) ) return;
+  for( i=0; i<warm.ndir; i++ ) if( strcmp(warm.dir[i], dir) == 0 ) return;
+  warm.dir[warm.ndir] = strdup(dir);
+  if( warm.dir[warm.ndir] != NULL ) warm.ndir++;
+}
+
+/* a small file of the new root, NUL-terminated */
+static ssize_t warm_read(const char* path, char* buf, size_t size) {
+  ssize_t n;
+  int fd;
+
+  fd = warm_open(path);
+  if( fd == -1 ) return -1;
+  n = read(fd, buf, size - 1);
+  close(fd);
+  buf[(n > 0) ? n : 0] = '\0';
+  return n;
+}
+
+/* warm.lock held; the directories listed in an ld.so.conf file */
+static void warm_ldconf(const char* path, int depth) {
+  char buf[4096];
+  char inc[512];
+  char* line;
+  char* next;
+  char* star;
+  DIR* d;
+  struct dirent* de;
+  int fd;
+
+  if( (depth > 2) || (warm_read(path, buf, sizeof(buf)) <= 0) ) return;
+  for( line = buf; *line != '\0'; line = next ) {
+    next = line + strcspn(line, "\n");
+    if( *next != '\0' ) *next++ = '\0';
+    line[strcspn(line, "#")] = '\0';
+    while( PARAM_BLANK(*line) ) line++;
+    line[strcspn(line, " \t")] = '\0';
+    if( strcmp(line, "include") == 0 ) {
+      line += strlen(line) + 1;
+      while( PARAM_BLANK(*line) ) line++;
+      line[strcspn(line, " \t")] = '\0';
+      /* only "dir/prefix*suffix" patterns, which is what distributions use */
+      star = strchr(line, '*');
+      if( (star == NULL) || (strrchr(line, '/') == NULL) || (strrchr(line, '/') > star) ) {
+        warm_ldconf(line, depth + 1);
+        continue;
+      }
+      *strrchr(line, '/') = '\0';
+      fd = warm_open(line);
+      d = (fd == -1) ? NULL : fdopendir(fd);
+      if( (d == NULL) && (fd != -1) ) close(fd);
+      while( (d != NULL) && ((de = readdir(d)) != NULL) ) {
+        if( de->d_name[0] == '.' ) continue;
+        if( strlen(de->d_name) < strlen(star + 1) ) continue;
+        if( strcmp(de->d_name + strlen(de->d_name) - strlen(star + 1), star + 1) != 0 ) continue;
+        snprintf(inc, sizeof(inc), "%s/%s", line, de->d_name);
+        warm_ldconf(inc, depth + 1);
+      }
+      if( d != NULL ) closedir(d);
+    } else if( *line != '\0' ) warm_add_dir(line);
+  }
+}
+
+/* warm.lock held; add the library name, looked up in runpath and warm.dir */
+static void warm_lib(const char* name, char* runpath) {
+  char path[512];
+  char* save = NULL;
+  char* dir;
+  int i, fd = -1;
+
+  if( strchr(name, '/') != NULL ) {
+    warm_add(name);
+    return;
+  }
+  for( dir = (runpath == NULL) ? NULL : strtok_r(runpath, ":", &save); (dir != NULL) && (fd == -1); dir = strtok_r(NULL, ":", &save) ) {
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if( dir[0] == '/' ) fd = warm_open(path);
+  }
+  for( i=0; (i < warm.ndir) && (fd == -1); i++ ) {
+    snprintf(path, sizeof(path), "%s/%s", warm.dir[i], name);
+    fd = warm_open(path);
+  }
+  if( fd == -1 ) return;
+  close(fd);
+  warm_add(path);
+}
+
+/* file offset of a virtual address, by the PT_LOAD segments */
+static off_t warm_off(unsigned long long* load, int nload, unsigned long long vaddr) {
+  int i;
+
+  for( i=0; i<nload; i++ )
+    if( (vaddr >= load[3*i]) && (vaddr < load[3*i] + load[3*i+2]) ) return load[3*i+1] + (vaddr - load[3*i]);
+  return -1;
+}
+
+/* queue the loader and libraries an ELF file needs */
+static void warm_elf(int fd) {
+  union { Elf32_Ehdr e32; Elf64_Ehdr e64; } eh;
+  unsigned char ph[64 * sizeof(Elf64_Phdr)];
+  unsigned char dyn[8192];
+  unsigned long long load[3*16]; /* vaddr, offset, filesz */
+  unsigned long long type, off, vaddr, filesz, val, strtab = 0, runpath = 0;
+  long long tag;
+  unsigned long long needed[32];
+  char name[256];
+  char rp[512];
+  char rpc[512];
+  ssize_t n;
+  int is64, phnum, phsize, i, nload = 0, nneeded = 0, ndyn = 0, dynsize;
+
+  if( (pread(fd, &eh, sizeof(eh), 0) < (ssize_t) sizeof(eh.e32)) || (memcmp(eh.e32.e_ident, ELFMAG, SELFMAG) != 0) ) return;
+  is64 = (eh.e32.e_ident[EI_CLASS] == ELFCLASS64);
+  phnum = is64 ? eh.e64.e_phnum : eh.e32.e_phnum;
+  phsize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+  if( (phnum > 64) || ((is64 ? eh.e64.e_phentsize : eh.e32.e_phentsize) != phsize) ) return;
+  if( pread(fd, ph, phnum * phsize, is64 ? eh.e64.e_phoff : eh.e32.e_phoff) != phnum * phsize ) return;
+  for( i=0; i<phnum; i++ ) {
+    type = is64 ? ((Elf64_Phdr*) ph)[i].p_type : ((Elf32_Phdr*) ph)[i].p_type;
+    off = is64 ? ((Elf64_Phdr*) ph)[i].p_offset : ((Elf32_Phdr*) ph)[i].p_offset;
+    vaddr = is64 ? ((Elf64_Phdr*) ph)[i].p_vaddr : ((Elf32_Phdr*) ph)[i].p_vaddr;
+    filesz = is64 ? ((Elf64_Phdr*) ph)[i].p_filesz : ((Elf32_Phdr*) ph)[i].p_filesz;
+    if( (type == PT_LOAD) && (nload < 16) ) {
+      load[3*nload] = vaddr;
+      load[3*nload+1] = off;
+      load[3*nload+2] = filesz;
+      nload++;
+    } else if( (type == PT_INTERP) && (filesz < sizeof(name)) && (pread(fd, name, filesz, off) == (ssize_t) filesz) ) {
+      name[filesz] = '\0';
+      pthread_mutex_lock(&warm.lock);
+      warm_add(name);
+      pthread_mutex_unlock(&warm.lock);
+    } else if( type == PT_DYNAMIC ) {
+      n = pread(fd, dyn, (filesz < sizeof(dyn)) ? filesz : sizeof(dyn), off);
+      dynsize = is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+      ndyn = (n > 0) ? n / dynsize : 0;
+    }
+  }
+  for( i=0; i<ndyn; i++ ) {
+    tag = is64 ? ((Elf64_Dyn*) dyn)[i].d_tag : ((Elf32_Dyn*) dyn)[i].d_tag;
+    val = is64 ? ((Elf64_Dyn*) dyn)[i].d_un.d_val : ((Elf32_Dyn*) dyn)[i].d_un.d_val;
+    if( tag == DT_NULL ) break;
+    if( tag == DT_STRTAB ) strtab = val;
+    else if( (tag == DT_NEEDED) && (nneeded < 32) ) needed[nneeded++] = val;
+    else if( (tag == DT_RUNPATH) || ((tag == DT_RPATH) && (runpath == 0)) ) runpath = val + 1;
+  }
+  if( (nneeded == 0) || ((off = warm_off(load, nload, strtab)) == (unsigned long long) -1) ) return;
+  rp[0] = '\0';
+  if( (runpath != 0) && (pread(fd, rp, sizeof(rp) - 1, off + runpath - 1) > 0) ) rp[sizeof(rp) - 1] = '\0';
+  /* $ORIGIN and friends need the path the loader saw; leave them out */
+  if( strchr(rp, '$') != NULL ) rp[0] = '\0';
+  for( i=0; i<nneeded; i++ ) {
+    if( pread(fd, name, sizeof(name) - 1, off + needed[i]) <= 0 ) continue;
+    name[sizeof(name) - 1] = '\0';
+    pthread_mutex_lock(&warm.lock);
+    warm_lib(name, (rp[0] != '\0') ? strcpy(rpc, rp) : NULL);
+    pthread_mutex_unlock(&warm.lock);
+  }
+}
+
+static void* warm_worker(void* arg) {
+  struct stat st;
+  char* path;
+  int fd;
+
+  pthread_mutex_lock(&warm.lock);
+  for(;;) {
+    while( (warm.next == warm.nfile) && (warm.busy > 0) ) pthread_cond_wait(&warm.cond, &warm.lock);
+    if( warm.next == warm.nfile ) break;
+    path = warm.file[warm.next++];
+    warm.busy++;
+    pthread_mutex_unlock(&warm.lock);
+
+    fd = warm_open(path);
+    if( fd != -1 ) {
+      if( fstat(fd, &st) == 0 ) {
+        posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+        __sync_fetch_and_add(&warm.bytes, st.st_size);
+      }
+      warm_elf(fd);
+      close(fd);
+    }
+
+    pthread_mutex_lock(&warm.lock);
+    warm.busy--;
+    pthread_cond_broadcast(&warm.cond);
+  }
+  pthread_mutex_unlock(&warm.lock);
+  return NULL;
+}
+
+/* start warming the program at path under root */
+void warm_start(const char* root, const char* path) {
+  static const char* const libdirs[] = { "/lib64", "/usr/lib64", "/lib", "/usr/lib" };
+  unsigned int i;
+
+  warm.rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if( warm.rootfd == -1 ) return;
+  pthread_mutex_lock(&warm.lock);
+  warm_ldconf("/etc/ld.so.conf", 0);
+  for( i=0; i < sizeof(libdirs)/sizeof(libdirs[0]); i++ ) warm_add_dir(libdirs[i]);
+  warm_add(path);
+  pthread_mutex_unlock(&warm.lock);
+  for( warm.nth = 0; warm.nth < WARM_THREADS; warm.nth++ )
+    if( pthread_create(&warm.th[warm.nth], NULL, warm_worker, NULL) != 0 ) break;
+}
+
+/* wait for warm_start(); returns the number of files warmed */
+int warm_wait(unsigned long long* bytes) {
+  int i;
+
+  for( i=0; i<warm.nth; i++ ) pthread_join(warm.th[i], NULL);
+  warm.nth = 0;
+  for( i=0; i<warm.ndir; i++ ) free(warm.dir[i]);
+  for( i=0; i<warm.nfile; i++ ) free(warm.file[i]);
+  if( warm.rootfd != -1 ) close(warm.rootfd);
+  warm.rootfd = -1;
+  *bytes = warm.bytes;
+  return warm.nfile;
+}
+
+/*** readahead: record and replay the reads of the first seconds of boot
+ *
+ * bootreadahead=record and bootreadahead=replay each fork a helper just
+ * before execl(); it lives on beside the real init, chrooted like it.
+ *
+ * The record helper marks the root mount with fanotify and notes every
+ * regular file opened for bootreadahead_time= seconds. It then asks
+ * mincore() which parts of those files are in the page cache, and FIEMAP
+ * where each part starts on disk, and writes one line per part to
+ * READAHEAD_LIST, in the order the files were first opened:
+ *
+ *   <physical byte> <file offset> <length> <path>
+ *
+ * The root is often still read-only at that point; the list is written as
+ * soon as a retry succeeds within READAHEAD_WRITE_WAIT seconds.
+ *
+ * The replay helper maps the list, sorts it by physical byte so the disk
+ * is read in one sweep, and reads the parts through io_uring at idle I/O
+ * priority with at most READAHEAD_DEPTH reads in flight, or with
+ * POSIX_FADV_WILLNEED where io_uring is not available.
+ *
+ * Either helper ends itself when done, and alarm() kills one that is not
+ * done by READAHEAD_LIFETIME seconds after the time it was given.
+ */
+#define READAHEAD_LIST       "/var/lib/foobarz-init.readahead"
+#define READAHEAD_MAX        8192   /* files recorded, lines replayed */
+#define READAHEAD_CHUNK      131072 /* bytes per read */
+#define READAHEAD_DEPTH      32     /* reads in flight */
+#define READAHEAD_WRITE_WAIT 120
+#define READAHEAD_LIFETIME   180
+
+#define READAHEAD_IOPRIO_IDLE (3 << 13) /* IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0) */
+
+/* <fcntl.h> has these only with _GNU_SOURCE */
+#ifndef O_NOATIME
+#define O_NOATIME 01000000
+#endif
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+struct ra_file { dev_t dev; ino_t ino; char* path; };
+struct ra_line { unsigned long long phys; unsigned long long off; unsigned long long len; char* path; };
+
+/* physical byte at off in the file, or ~0 if the filesystem will not say */
+static unsigned long long ra_phys(int fd, unsigned long long off) {
+  struct { struct fiemap fm; struct fiemap_extent fe; } f;
+
+  memset(&f, 0, sizeof(f));
+  f.fm.fm_start = off;
+  f.fm.fm_length = 1;
+  f.fm.fm_extent_count = 1;
+  if( (ioctl(fd, FS_IOC_FIEMAP, &f.fm) != 0) || (f.fm.fm_mapped_extents == 0) ) return ~0ULL;
+  if( f.fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE) ) return ~0ULL;
+  return f.fe.fe_physical + (off - f.fe.fe_logical);
+}
+
+/* append the cached parts of a file to the list */
+static int ra_record_file(struct fdout* out, const char* path) {
+  struct stat st;
+  unsigned char vec[4096];
+  unsigned long long page = sysconf(_SC_PAGESIZE);
+  unsigned long long off, len, pos, end;
+  unsigned long i, n;
+  void* map;
+  int fd, lines = 0;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+  if( (fd == -1) && (errno == EPERM) ) fd = open(path, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return 0;
+  if( (fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size == 0) ) {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if( map == MAP_FAILED ) {
+    close(fd);
+    return 0;
+  }
+  /* walk the file a vec[] of pages at a time; a part may span walks */
+  len = 0;
+  off = 0;
+  for( pos = 0; pos < (unsigned long long) st.st_size; pos += n * page ) {
+    end = pos + sizeof(vec) * page;
+    if( end > (unsigned long long) st.st_size ) end = st.st_size;
+    n = (end - pos + page - 1) / page;
+    if( mincore((char*) map + pos, end - pos, vec) != 0 ) break;
+    for( i=0; i<n; i++ ) {
+      if( vec[i] & 1 ) {
+        if( len == 0 ) off = pos + i * page;
+        len += page;
+        continue;
+      }
+      if( len == 0 ) continue;
+      fdout_printf(out, "%llu %llu %llu %s\n", ra_phys(fd, off), off, len, path);
+      lines++;
+      len = 0;
+    }
+  }
+  if( len != 0 ) {
+    fdout_printf(out, "%llu %llu %llu %s\n", ra_phys(fd, off), off, len, path);
+    lines++;
+  }
+  munmap(map, st.st_size);
+  close(fd);
+  return lines;
+}
+
+/* record helper; runs in the new root, and closes ready once it watches */
+static void ra_record(int seconds, int ready) {
+  static struct ra_file file[READAHEAD_MAX];
+  static struct fdout out;
+  struct fanotify_event_metadata buf[64];
+  struct fanotify_event_metadata* ev;
+  struct pollfd pfd;
+  struct timespec t0;
+  struct stat st;
+  char link[32];
+  char path[4096];
+  ssize_t len;
+  long left;
+  int fan, nfile = 0, lines = 0, i, n;
+
+  fan = syscall(SYS_fanotify_init, FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_NOATIME);
+  if( (fan == -1) || (syscall(SYS_fanotify_mark, fan, FAN_MARK_ADD | FAN_MARK_MOUNT, (unsigned long long) FAN_OPEN, AT_FDCWD, "/") != 0) ) {
+    printk(KERN_WARNING "bootreadahead: %s: %s\n", (fan == -1) ? "fanotify_init" : "fanotify_mark", strerror(errno));
+    if( fan != -1 ) close(fan);
+    close(ready);
+    klog_flush();
+    return;
+  }
+  close(ready);
+  printk("bootreadahead: recording for %d seconds.\n", seconds);
+  klog_flush();
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pfd.fd = fan;
+  pfd.events = POLLIN;
+  while( ((left = seconds * 1000L - klog_ms_since(&t0)) > 0) && (nfile < READAHEAD_MAX) ) {
+    if( poll(&pfd, 1, left) <= 0 ) continue;
+    len = read(fan, buf, sizeof(buf));
+    for( ev = buf; (len > 0) && FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len) ) {
+      if( ev->fd < 0 ) continue;
+      if( (ev->pid != getpid()) && (fstat(ev->fd, &st) == 0) && S_ISREG(st.st_mode) ) {
+        for( i=0; i<nfile; i++ ) if( (file[i].dev == st.st_dev) && (file[i].ino == st.st_ino) ) break;
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", ev->fd);
+        if( (i == nfile) && (nfile < READAHEAD_MAX) && ((n = readlink(link, path, sizeof(path) - 1)) > 0) ) {
+          path[n] = '\0';
+          /* deleted files and paths that would break the list */
+          if( (path[0] == '/') && (strchr(path, '\n') == NULL) && ((file[nfile].path = strdup(path)) != NULL) ) {
+            file[nfile].dev = st.st_dev;
+            file[nfile].ino = st.st_ino;
+            nfile++;
+          }
+        }
+      }
+      close(ev->fd);
+    }
+  }
+  close(fan);
+
+  /* the list is written whole or not at all */
+  snprintf(path, sizeof(path), "%s.new", READAHEAD_LIST);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while( (out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ) {
+    if( (errno != EROFS) || (klog_ms_since(&t0) > READAHEAD_WRITE_WAIT * 1000L) ) {
+      printk(KERN_WARNING "bootreadahead: %s: %s\n", path, strerror(errno));
+      klog_flush();
+      return;
+    }
+    sleep(1);
+  }
+  for( i=0; i<nfile; i++ ) lines += ra_record_file(&out, file[i].path);
+  if( (fdout_close(&out) != 0) || (rename(path, READAHEAD_LIST) != 0) ) {
+    printk(KERN_WARNING "bootreadahead: %s: %s\n", READAHEAD_LIST, strerror(errno));
+    unlink(path);
+  } else printk("bootreadahead: recorded %d files in %d parts to %s.\n", nfile, lines, READAHEAD_LIST);
+  klog_flush();
+}
+
+static int ra_line_cmp(const void* a, const void* b) {
+  const struct ra_line* x = a;
+  const struct ra_line* y = b;
+
+  if( x->phys != y->phys ) return (x->phys < y->phys) ? -1 : 1;
+  if( x->path != y->path ) return (x->path < y->path) ? -1 : 1;
+  return (x->off < y->off) ? -1 : (x->off > y->off);
+}
+
+/* io_uring, set up by hand; just enough for a queue of reads */
+struct ra_ring {
+  int fd;
+  unsigned* sq_head; unsigned* sq_tail; unsigned* sq_mask; unsigned* sq_array;
+  unsigned* cq_head; unsigned* cq_tail; unsigned* cq_mask;
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+};
+
+static int ra_ring_init(struct ra_ring* r, unsigned entries) {
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  char* sq;
+  char* cq;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(SYS_io_uring_setup, entries, &p);
+  if( r->fd == -1 ) return -1;
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if( (p.features & IORING_FEAT_SINGLE_MMAP) && (cq_size > sq_size) ) sq_size = cq_size;
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if( sq == MAP_FAILED ) goto fail;
+  cq = sq;
+  if( !(p.features & IORING_FEAT_SINGLE_MMAP) ) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if( cq == MAP_FAILED ) goto fail;
+  }
+  r->sqe = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if( r->sqe == MAP_FAILED ) goto fail;
+  r->sq_head = (unsigned*) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*) (sq + p.sq_off.array);
+  r->cq_head = (unsigned*) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  r->cqe = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  return 0;
+fail:
+  /* the mappings go with the helper */
+  close(r->fd);
+  return -1;
+}
+
+/* queue a read; submitted by the next ra_ring_wait() */
+static void ra_ring_read(struct ra_ring* r, int fd, void* buf, unsigned len, unsigned long long off, unsigned long long data) {
+  unsigned tail = *r->sq_tail;
+  unsigned i = tail & *r->sq_mask;
+
+  memset(&r->sqe[i], 0, sizeof(r->sqe[i]));
+  r->sqe[i].opcode = IORING_OP_READ;
+  r->sqe[i].ioprio = READAHEAD_IOPRIO_IDLE;
+  r->sqe[i].fd = fd;
+  r->sqe[i].addr = (unsigned long) buf;
+  r->sqe[i].len = len;
+  r->sqe[i].off = off;
+  r->sqe[i].user_data = data;
+  r->sq_array[i] = i;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* submit what is queued, wait for one completion and return its user_data */
+static unsigned long long ra_ring_wait(struct ra_ring* r, unsigned submit) {
+  unsigned head;
+  unsigned long long data;
+
+  while( (head = *r->cq_head) == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) ) {
+    if( (syscall(SYS_io_uring_enter, r->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1) && (errno != EINTR) ) return ~0ULL;
+    submit = 0;
+  }
+  data = r->cqe[head & *r->cq_mask].user_data;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return data;
+}
+
+/* replay helper; runs in the new root */
+static void ra_replay(void) {
+  static struct ra_line line[READAHEAD_MAX];
+  static int lfd[READAHEAD_MAX];       /* fd of a line being read */
+  static int pending[READAHEAD_MAX];   /* its reads in flight */
+  static char chunk[READAHEAD_CHUNK];  /* read and thrown away */
+  struct ra_ring ring;
+  struct stat st;
+  unsigned long long bytes = 0, off;
+  unsigned queued = 0, inflight = 0, n;
+  char* map;
+  char* p;
+  char* end;
+  char* eol;
+  int fd, nline = 0, i, uring;
+
+  fd = open(READAHEAD_LIST, O_RDONLY | O_CLOEXEC);
+  if( (fd == -1) || (fstat(fd, &st) != 0) || (st.st_size == 0) ) {
+    printk("bootreadahead: %s: %s; nothing to replay.\n", READAHEAD_LIST, (fd == -1) ? strerror(errno) : "empty");
+    if( fd != -1 ) close(fd);
+    klog_flush();
+    return;
+  }
+  /* a private map: the newlines become string ends */
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if( map == MAP_FAILED ) return;
+  for( p = map, end = map + st.st_size; (p < end) && (nline < READAHEAD_MAX); p = eol + 1 ) {
+    eol = memchr(p, '\n', end - p);
+    if( eol == NULL ) break;
+    *eol = '\0';
+    line[nline].phys = strtoull(p, &p, 10);
+    line[nline].off = strtoull(p, &p, 10);
+    line[nline].len = strtoull(p, &p, 10);
+    if( (p[0] == ' ') && (p[1] == '/') && (line[nline].len > 0) ) line[nline++].path = p + 1;
+  }
+  qsort(line, nline, sizeof(line[0]), ra_line_cmp);
+
+  uring = (ra_ring_init(&ring, READAHEAD_DEPTH) == 0);
+  printk("bootreadahead: replaying %d parts of %s with %s.\n", nline, READAHEAD_LIST, uring ? "io_uring" : "fadvise");
+  klog_flush();
+  for( i=0; i<nline; i++ ) {
+    lfd[i] = open(line[i].path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if( (lfd[i] == -1) && (errno == EPERM) ) lfd[i] = open(line[i].path, O_RDONLY | O_CLOEXEC);
+    if( lfd[i] == -1 ) continue;
+    bytes += line[i].len;
+    if( !uring ) {
+      posix_fadvise(lfd[i], line[i].off, line[i].len, POSIX_FADV_WILLNEED);
+      close(lfd[i]);
+      continue;
+    }
+    pending[i] = 0;
+    for( off = line[i].off; off < line[i].off + line[i].len; off += n ) {
+      /* a free slot first; a finished line closes its file */
+      while( inflight == READAHEAD_DEPTH ) {
+        n = ra_ring_wait(&ring, queued);
+        queued = 0;
+        if( n == ~0U ) {
+          if( pending[i] == 0 ) close(lfd[i]);
+          goto broken;
+        }
+        inflight--;
+        if( (n < (unsigned) nline) && (--pending[n] == 0) ) close(lfd[n]);
+      }
+      n = line[i].off + line[i].len - off;
+      if( n > READAHEAD_CHUNK ) n = READAHEAD_CHUNK;
+      ra_ring_read(&ring, lfd[i], chunk, n, off, i);
+      pending[i]++;
+      queued++;
+      inflight++;
+    }
+  }
+  while( inflight > 0 ) {
+    n = ra_ring_wait(&ring, queued);
+    queued = 0;
+    if( n == ~0U ) goto broken;
+    inflight--;
+    if( (n < (unsigned) nline) && (--pending[n] == 0) ) close(lfd[n]);
+  }
+  printk("bootreadahead: replayed %llu kB.\n", bytes / 1024);
+  klog_flush();
+  return;
+broken:
+  /* the ring failed: close the files that still have reads in it */
+  printk(KERN_WARNING "bootreadahead: io_uring_enter: %s; replay stopped.\n", strerror(errno));
+  for( i=0; i<nline; i++ ) if( pending[i] > 0 ) close(lfd[i]);
+  klog_flush();
+}
+
+/* fork the helper of param[ibootreadahead]; called last before execl() */
+void ra_start(void) {
+  struct pollfd pfd;
+  pid_t pid;
+  int seconds = 0, fd, ready[2];
+
+  if( param[ibootreadahead].v == NULL ) return;
+  if( strcmp(param[ibootreadahead].v, "record") == 0 ) seconds = atoi(param[ibootreadahead_time].v);
+  if( pipe(ready) != 0 ) return;
+  pid = fork();
+  if( pid == -1 ) printk(KERN_WARNING "bootreadahead: fork: %s\n", strerror(errno));
+  if( pid != 0 ) {
+    /* the recorder should see the real init open its own program */
+    close(ready[1]);
+    pfd.fd = ready[0];
+    pfd.events = POLLIN;
+    if( pid != -1 ) poll(&pfd, 1, 1000);
+    close(ready[0]);
+    return;
+  }
+  close(ready[0]);
+
+  /* helper: out of the way of the real init and its console */
+  setsid();
+  prctl(PR_SET_NAME, "bootreadahead", 0, 0, 0);
+  fd = open("/dev/null", O_RDWR);
+  if( fd != -1 ) {
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    if( fd > 2 ) close(fd);
+  }
+  setpriority(PRIO_PROCESS, 0, 19);
+  syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, READAHEAD_IOPRIO_IDLE);
+  alarm(seconds + READAHEAD_LIFETIME);
+  if( seconds > 0 ) ra_record(seconds, ready[1]);
+  else {
+    close(ready[1]);
+    ra_replay();
+  }
+  _exit(0);
+}
+
+/*** modules: kernel module loader
+ *
+ * Loads the modules named by modules_load= (comma-separated) and in
+ * MODULES_MANIFEST (one module per line, optionally followed by its
+ * parameters; '#' starts a comment), and the modules they need according to
+ * modules.dep of the running kernel. Every module is a dag node that depends
+ * on the modules it needs, so modules that do not need each other are loaded
+ * concurrently with finit_module(2). Like modprobe, <module>.<param>= kernel
+ * parameters are passed on to the module.
+ *
+ * A compressed module is handed to the kernel with MODULE_INIT_COMPRESSED_FILE.
+ * A kernel before 5.17 or without CONFIG_MODULE_DECOMPRESS refuses that; with
+ * -DINCLUDE_MODULE_XZ (-llzma) or -DINCLUDE_MODULE_ZSTD (-lzstd) such a
+ * module is decompressed here and loaded with init_module(2) instead.
+ */
+#define MODULES_DIR      "/lib/modules"
+#define MODULES_MANIFEST "/etc/modules"
+#define MODULES_MAX      256 /* modules requested */
+
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+struct mod {
+  char* path;   /* from modules.dep, relative to the modules directory */
+  char* deps;   /* rest of its modules.dep line */
+  char* opts;   /* module parameters, malloc'd */
+  int node;     /* index in the dag, or -1 if not loaded */
+  int* dep;     /* dag indices of the modules it needs */
+  int ndep;
+};
+
+static int mod_dirfd = -1;
+static int mod_kdecompress = 1; /* kernel takes MODULE_INIT_COMPRESSED_FILE */
+
+static const char* mod_basename(const char* path) {
+  const char* base = strrchr(path, '/');
+
+  return (base == NULL) ? path : base + 1;
+}
+
+/* does the module file at path have the name in name[0..len)? */
+static int mod_name_eq(const char* path, const char* name, size_t len) {
+  const char* base = mod_basename(path);
+
+  for( ; len > 0; base++, name++, len-- )
+    if( (*base != *name) && !(((*base == '-') || (*base == '_')) && ((*name == '-') || (*name == '_'))) ) return 0;
+  return strncmp(base, ".ko", 3) == 0;
+}
+
+/* returns the index of the module in m[0..n), or -1 */
+static int mod_find(struct mod* m, int n, const char* name, size_t len) {
+  int i;
+
+  for( i=0; i<n; i++ ) if( mod_name_eq(m[i].path, name, len) ) return i;
+  return -1;
+}
+
+/* is the module in modules.builtin, whose lines have been NUL-terminated? */
+static int mod_builtin(const char* builtin, size_t size, const char* name) {
+  const char* line;
+
+  for( line = builtin; (line != NULL) && (line < builtin + size); line += strlen(line) + 1 )
+    if( mod_name_eq(line, name, strlen(name)) ) return 1;
+  return 0;
+}
+
+/* appends opt to the module parameters in *opts */
+static void mod_add_opts(char** opts, const char* opt, const char* val) {
+  size_t len = (*opts == NULL) ? 0 : strlen(*opts);
+  size_t vlen = (val == NULL) ? 0 : strlen(val) + 3;
+  char* p;
+
+  p = realloc(*opts, len + strlen(opt) + vlen + 2);
+  if( p == NULL ) return;
+  if( len > 0 ) p[len++] = ' ';
+  if( val == NULL ) strcpy(p + len, opt);
+  /* the kernel splits module parameters like the command line */
+  else snprintf(p + len, strlen(opt) + vlen + 1, (strpbrk(val, " \t\n") != NULL) ? "%s=\"%s\"" : "%s=%s", opt, val);
+  *opts = p;
+}
+
+/* gives module i a dag node, after the modules it needs */
+static int mod_want(struct mod* m, int n, int i, int* nnodes) {
+  char* save = NULL;
+  char* t;
+  int j, ndep = 1;
+
+  if( m[i].node != -1 ) return 0;
+  m[i].node = -2; /* being resolved */
+  for( t = m[i].deps; *t != '\0'; t++ ) if( *t == ' ' ) ndep++;
+  m[i].dep = calloc(ndep, sizeof(int));
+  if( m[i].dep == NULL ) return -1;
+  for( t = strtok_r(m[i].deps, " \t", &save); t != NULL; t = strtok_r(NULL, " \t", &save) ) {
+    for( j=0; (j < n) && (strcmp(m[j].path, t) != 0); j++ );
+    if( j == n ) {
+      printk(KERN_WARNING "modules: %s needs %s, which is not in modules.dep.\n", mod_basename(m[i].path), t);
+      continue;
+    }
+    if( mod_want(m, n, j, nnodes) != 0 ) return -1;
+    if( m[j].node >= 0 ) m[i].dep[m[i].ndep++] = m[j].node;
+  }
+  m[i].node = (*nnodes)++;
+  return 0;
+}
+
+#if defined(INCLUDE_MODULE_XZ)
+static char* mod_unxz(const unsigned char* in, size_t inlen, size_t* outlen) {
+  lzma_stream s = LZMA_STREAM_INIT;
+  lzma_ret r;
+  size_t size = 4 * inlen;
+  char* out;
+  char* p;
+
+  out = malloc(size);
+  if( (out == NULL) || (lzma_stream_decoder(&s, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) ) {
+    free(out);
+    errno = ENOMEM;
+    return NULL;
+  }
+  s.next_in = in;
+  s.avail_in = inlen;
+  s.next_out = (uint8_t*) out;
+  s.avail_out = size;
+  while( (r = lzma_code(&s, LZMA_FINISH)) == LZMA_OK ) {
+    if( s.avail_out > 0 ) continue;
+    p = realloc(out, 2 * size);
+    if( p == NULL ) break;
+    out = p;
+    s.next_out = (uint8_t*) out + size;
+    s.avail_out = size;
+    size *= 2;
+  }
+  *outlen = s.total_out;
+  lzma_end(&s);
+  if( r != LZMA_STREAM_END ) {
+    free(out);
+    errno = EINVAL;
+    return NULL;
+  }
+  return out;
+}
+#endif
 
-  f = fopen("/dev/kmsg", "w");
-  va_start(args, fmt);
-  vfprintf(f, fmt, args);
-  va_end(args);
-  fflush(f);
-  fclose(f);
-  /* avoid flooding kmsg and having msgs suppressed; 20msgs/sec */
-  usleep(50000);
+#if defined(INCLUDE_MODULE_ZSTD)
+static char* mod_unzstd(const unsigned char* in, size_t inlen, size_t* outlen) {
+  ZSTD_DStream* ds;
+  ZSTD_inBuffer ib = { in, inlen, 0 };
+  ZSTD_outBuffer ob;
+  size_t r, size = 4 * inlen, len = 0;
+  char* out;
+  char* p;
+
+  ds = ZSTD_createDStream();
+  out = malloc(size);
+  if( (ds == NULL) || (out == NULL) ) goto fail;
+  ZSTD_initDStream(ds);
+  for(;;) {
+    if( len == size ) {
+      p = realloc(out, size *= 2);
+      if( p == NULL ) goto fail;
+      out = p;
+    }
+    ob.dst = out + len;
+    ob.size = size - len;
+    ob.pos = 0;
+    r = ZSTD_decompressStream(ds, &ob, &ib);
+    if( ZSTD_isError(r) ) goto fail;
+    len += ob.pos;
+    if( (r == 0) && (ib.pos == ib.size) ) break;
+    /* input used up with a frame still open: truncated */
+    if( (ib.pos == ib.size) && (ob.pos < ob.size) ) goto fail;
+  }
+  ZSTD_freeDStream(ds);
+  *outlen = len;
+  return out;
+fail:
+  ZSTD_freeDStream(ds);
+  free(out);
+  errno = EINVAL;
+  return NULL;
 }
+#endif
 
-int main(int argc, char* argv[]) {
- /*** variables */
+/* load a module compressed by ext (".xz", ...) with init_module(2) */
+static int mod_init_decompressed(int fd, const char* ext, const char* opts) {
+  char* (*unpack)(const unsigned char*, size_t, size_t*) = NULL;
+  struct stat st;
+  unsigned char* in;
+  char* image;
+  size_t len = 0;
+  int ret, saved_errno;
 
- int i;
- int   fd = 0; /* file descriptor */
- unsigned long mountflags;
-
- /* kernel command line */
- off_t cmdline_size;
- char* cmdline; /* to be malloc 4096B */
- char* cmdline_end;
- char* temp_end;
- char* src_msg; /* default or cmdline */
- int flag_param_missing = 0;
-
- /* use to hold contents of a misc /proc/<file> */
- char* miscproc_buff; /* to be malloc 4096B */
- off_t miscproc_size;
-
- /* note about environ, argv, and kernel cmdline for init:
-  *   environ is not defined for init
-  *   only argv[0] is set for init
-  *   kernel command line parameters are accessed
-  *   at /proc/cmdline
-  */ 
-
- /* kernel parameters expected to be name=value */
- /* do not use quotes or spaces in parameters   */
- /* you can add more params somwhere after root= */
- struct nv { char* n; char* v; char* v_end; int req; int src; };
- struct nv param[] = {
-   { " root=",       NULL, NULL, PARAM_REQ_YES, PARAM_SRC_DEFAULT },
-   { " rootfstype=", NULL, NULL, PARAM_REQ_YES, PARAM_SRC_DEFAULT },
-   { " mountopt=",   NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT },
-   { " init=",       NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT },
-   { " runlevel=",   NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT },
-   { " console=",    NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT }
-#if defined(INCLUDE_ZPOOL_IMPORT)
-   ,
-   { " zpool_import_name=",    NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT },
-   { " zpool_import_guid=",    NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT },
-   { " zpool_import_newname=", NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT },
-   { " zpool_import_force=",   NULL, NULL, PARAM_REQ_NO , PARAM_SRC_DEFAULT }
-#endif
- };
- enum {
-	 iroot,
-	 irootfstype,
-	 imountopt,
-	 iinit,
-	 irunlevel,
-	 iconsole,
-#if defined(INCLUDE_ZPOOL_IMPORT)
-	 izpool_import_name,
-	 izpool_import_guid,
-	 izpool_import_newname,
-	 izpool_import_force,
+#if defined(INCLUDE_MODULE_XZ)
+  if( strcmp(ext, ".xz") == 0 ) unpack = mod_unxz;
 #endif
-	 ilastparam
- };
- 
-#if defined(INCLUDE_ZPOOL_IMPORT) 
- libzfs_handle_t* libzfs = NULL;
- importargs_t iargs = { 0 };
- nvlist_t* pools = NULL;
- nvpair_t* pool = NULL;
- nvlist_t* config = NULL;
+#if defined(INCLUDE_MODULE_ZSTD)
+  if( strcmp(ext, ".zst") == 0 ) unpack = mod_unzstd;
 #endif
+  if( unpack == NULL ) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  if( fstat(fd, &st) == -1 ) return -1;
+  in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if( in == MAP_FAILED ) return -1;
+  image = unpack(in, st.st_size, &len);
+  saved_errno = errno;
+  munmap(in, st.st_size);
+  if( image == NULL ) {
+    errno = saved_errno;
+    return -1;
+  }
+  ret = syscall(SYS_init_module, image, len, opts);
+  saved_errno = errno;
+  free(image);
+  errno = saved_errno;
+  return ret;
+}
 
- /*** program */
+/* dag node: load one module */
+static int mod_load(void* arg) {
+  struct mod* m = arg;
+  const char* name = mod_basename(m->path);
+  const char* opts = (m->opts == NULL) ? "" : m->opts;
+  const char* ext = strrchr(name, '.');
+  int compressed = (ext != NULL) && (strcmp(ext, ".ko") != 0);
+  int fd, err, ret = -1;
 
- printk("foobarz-init, version %s: booting initramfs.\n", FOOBARZ_INIT_VERSION);
+  fd = openat(mod_dirfd, m->path, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) {
+    printk(KERN_ERR "modules: %s: %s\n", m->path, strerror(errno));
+    return EX_OSFILE;
+  }
+  if( !compressed || mod_kdecompress )
+    ret = syscall(SYS_finit_module, fd, opts, compressed ? MODULE_INIT_COMPRESSED_FILE : 0);
+  if( compressed && (ret == -1) && (!mod_kdecompress || (errno == EINVAL) || (errno == EOPNOTSUPP)) ) {
+    err = mod_kdecompress ? errno : EOPNOTSUPP;
+    ret = mod_init_decompressed(fd, ext, opts);
+    if( ret == 0 ) mod_kdecompress = 0;
+    else if( errno == EOPNOTSUPP ) {
+      errno = err;
+      if( err == EOPNOTSUPP )
+        printk(KERN_ERR "modules: %s: the kernel cannot decompress it and this init was built without support for %s.\n", name, ext);
+    }
+  }
+  close(fd);
+  if( ret == -1 ) {
+    if( errno == EEXIST ) {
+      printk("modules: %s is already loaded.\n", name);
+      return 0;
+    }
+    /* drivers for hardware that is not there are not an error */
+    if( errno == ENODEV ) {
+      printk(KERN_WARNING "modules: %s: no such device.\n", name);
+      return 0;
+    }
+    printk(KERN_ERR "modules: %s: %s\n", name, strerror(errno));
+    return EX_UNAVAILABLE;
+  }
+  printk("modules: loaded %s%s%s\n", name, (opts[0] != '\0') ? " " : "", opts);
+  return 0;
+}
 
- cmdline       = (char*) malloc(4096);
- miscproc_buff = (char*) malloc(4096);
- if( (cmdline == NULL) || (miscproc_buff == NULL) ) {
-   printk("Unable to allocate buffer memory: malloc: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- }
+/*** boot stages
+ *
+ * Each step of bringing up the root filesystem is a node in stage[] below,
+ * run by dag_run(). A stage returns 0 or an EX_* code that aborts the boot.
+ * To add a step, write a stage_ function, give it an S_ index and list the
+ * stages it needs in its DEPS().
+ */
 
- /* mount proc /proc
-  *  note: some /dev devices symlink into /proc
-  *  proc contains info about processes, including cmdline etc. */
- printk("Attempting cmd: mount proc /proc\n");
- if( mount("proc", "/proc", "proc", 0, NULL) != 0 ) {
-   printk("time to panic: mount: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- } else {
-   printk("Mount proc successful.\n");  
- }
+/* mount proc /proc
+ *  note: some /dev devices symlink into /proc
+ *  proc contains info about processes, including cmdline etc. */
+static int stage_mount_proc(void* arg) {
+  if( mnt_is_mountpoint("/proc") ) {
+    printk("/proc is already mounted; using it.\n");
+  } else {
+    printk("Attempting cmd: mount proc /proc\n");
+    if( mnt_mount("proc", "/proc", "proc", 0, NULL) != 0 ) {
+      printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
+      return EX_UNAVAILABLE;
+    }
+    printk("Mount proc successful.\n");
+  }
+  klog_probe_ratelimit();
+  return 0;
+}
 
- /* mount devtmpfs /dev
-  *  note: This simple init program works if your root device is made from devices
-  *  that are available by default in devtmpfs, such as /dev/sd*
-  * 
-  *  For zfs, your root zfs pool should be created with default device nodes and
-  *  then it should be mountable by this simple init program.
-  *
-  *  udev may be needed to configure device nodes and symlinks required
-  *  to access a root device configuration made with such nodes and symlinks.
-  *  If you need udevd, you can include it into your initramfs-source and
-  *  modify this program to run it before attempting to mount your root device.
-  *  However, if udevd is needed, a significant number of userspace programs may also be
-  *  required by rules in /lib/udev/. You could install busybox + udev (about 5MB) or
-  *  coreutils + util-linux + bash + udev (about 25MB) into initramfs-source. But, at that
-  *  point you'd have ash or bash and many tools that are easier to use than this
-  *  simple init program; it would then be easy to have /init as #!/bin/<b>ash script. */
- printk("Attempting cmd: mount devtmpfs /dev\n");
- if( mount("devtmpfs", "/dev", "devtmpfs", 0, NULL) != 0 ) {
-   printk("time to panic: mount: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- } else {
-   printk("Mount devtmpfs successful.\n");
- }
+/* mount devtmpfs /dev
+ *  note: This simple init program works if your root device is made from devices
+ *  that are available by default in devtmpfs, such as /dev/sd*
+ * 
+ *  For zfs, your root zfs pool should be created with default device nodes and
+ *  then it should be mountable by this simple init program.
+ *
+ *  udev may be needed to configure device nodes and symlinks required
+ *  to access a root device configuration made with such nodes and symlinks.
+ *  If you need udevd, you can include it into your initramfs-source and
+ *  modify this program to run it before attempting to mount your root device.
+ *  However, if udevd is needed, a significant number of userspace programs may also be
+ *  required by rules in /lib/udev/. You could install busybox + udev (about 5MB) or
+ *  coreutils + util-linux + bash + udev (about 25MB) into initramfs-source. But, at that
+ *  point you'd have ash or bash and many tools that are easier to use than this
+ *  simple init program; it would then be easy to have /init as #!/bin/<b>ash script. */
+static int stage_mount_dev(void* arg) {
+  if( mnt_is_mountpoint("/dev") ) {
+    printk("/dev is already mounted; using it.\n");
+  } else {
+    printk("Attempting cmd: mount devtmpfs /dev\n");
+    if( mnt_mount("devtmpfs", "/dev", "devtmpfs", 0, NULL) != 0 ) {
+      printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
+      return EX_UNAVAILABLE;
+    }
+    printk("Mount devtmpfs successful.\n");
+  }
+  return 0;
+}
 
- /* mount sysfs /sys
-  *  note: some kernel modules try to access /sys with userspace helpers to echo values into /sys variables;
-  *  such modules expect a minimal userspace that contains coreutils or busybox */
- printk("Attempting cmd: mount sysfs /sys\n");
- if( mount("sysfs", "/sys", "sysfs", 0, NULL) != 0 ) {
-   printk("time to panic: mount: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- } else {
-   printk("Mount sysfs successful.\n");
- }
+/* mount sysfs /sys
+ *  note: some kernel modules try to access /sys with userspace helpers to echo values into /sys variables;
+ *  such modules expect a minimal userspace that contains coreutils or busybox */
+static int stage_mount_sys(void* arg) {
+  if( mnt_is_mountpoint("/sys") ) {
+    printk("/sys is already mounted; using it.\n");
+  } else {
+    printk("Attempting cmd: mount sysfs /sys\n");
+    if( mnt_mount("sysfs", "/sys", "sysfs", 0, NULL) != 0 ) {
+      printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
+      return EX_UNAVAILABLE;
+    }
+    printk("Mount sysfs successful.\n");
+  }
+  return 0;
+}
 
- /* process kernel command line */
- fd = open("/proc/cmdline", O_RDONLY);
- if( fd == -1 ) {
-   printk("Cannot open /proc/cmdline: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- }
- /* note, on /proc fs:
-  *       lseek likely always returns error
-  *       stat likely always returns st_size = 0
-  *   so determining size of /proc file means just reading it;
-  *   you have to read /proc files according to their documented
-  *   maximum sizes; this is probably for performance reasons */
- cmdline_size = read(fd, cmdline, 4095);
- if( cmdline_size == -1 ) {
-   printk("Failed to read /proc/cmdline: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- }
- close(fd);
-
- /* cmdline may be newline + null terminated, but make it null + null */
- cmdline[cmdline_size] = '\0';
- if( cmdline[cmdline_size-1] == '\n' ) {
-   cmdline[cmdline_size-1] = '\0';
-   cmdline_size--;
-   cmdline_end = cmdline + cmdline_size;
- }
- printk("Kernel cmdline size: %i\n", cmdline_size);
- printk("Kernel cmdline: \"%s\"\n", cmdline);
-
- /* find v and v_end of values in cmdline */
- for( i=iroot; i<ilastparam; i++ ) {
-   param[i].v = strstr(cmdline, param[i].n);
-   if( param[i].v != NULL ) {
-     param[i].src = PARAM_SRC_CMDLINE;
-     while( *(param[i].v) != '=' ) param[i].v++;
-     param[i].v++;
-     temp_end = param[i].v;
-     while( !( (*temp_end == ' ') ||
-               (*temp_end == '\n') ||
-               (temp_end == cmdline_end)
-	     ) ) temp_end++;
-     if( temp_end == param[i].v ) {
-       printk("Kernel parameter %s: value missing.\n", param[i].n);
-       param[i].v = NULL;
-     } else param[i].v_end = temp_end;
-   }
- }
+/* process kernel command line */
+static int stage_cmdline(void* arg) {
+  size_t cmdline_size;
+  char* args;
+  char* name;
+  char* val;
+  char* src_msg; /* default or cmdline */
+  int i, flag_param_missing = 0;
 
- /* set defaults for params not given on cmdline */
- for( i=iroot; i<ilastparam; i++ ) {
-   /* terminate value strings */
-   if( param[i].v_end != NULL ) *(param[i].v_end) = '\0';
-   /* set defaults if no value on cmdline */
-   if( param[i].v == NULL ) {
-     param[i].src = PARAM_SRC_DEFAULT;
-     if( param[i].req == PARAM_REQ_YES ) flag_param_missing = 1;
-     switch(i) {
-       case iroot      : param[i].v = "<missing required param>" ; break;
-       case irootfstype: param[i].v = "<missing required param>" ; break;
-       case imountopt  : param[i].v = "ro"        ; break;
-       case iinit      : param[i].v = "/sbin/init"; break;
-       case irunlevel  : param[i].v = "3"         ; break;
-       case iconsole   : param[i].v = "console"   ; break;
-       default         : param[i].v = NULL;
-     }
-   }
-   if(param[i].src == PARAM_SRC_DEFAULT) src_msg = "default";
-   else src_msg = "cmdline";
-   printk("Using %s \"%s\" (source: %s)\n", param[i].n, param[i].v, src_msg);
- }
+  if( param_hash_init() != 0 ) {
+    printk(KERN_ERR "Parameter registry: no collision-free hash seed; grow PARAM_HASH_SIZE.\n");
+    return EX_SOFTWARE;
+  }
 
- if( flag_param_missing ) {
-   printk("Aborting boot process: missing required kernel parameter(s).\n");
-   return EX_USAGE;
- }
+  cmdline = read_proc_file(PROC_CMDLINE, &cmdline_size);
+  if( cmdline == NULL ) {
+    printk(KERN_ERR "Failed to read %s: %s\n", PROC_CMDLINE, strerror(errno));
+    return EX_UNAVAILABLE;
+  }
+  /* cmdline may be newline + null terminated, but make it null + null */
+  if( (cmdline_size > 0) && (cmdline[cmdline_size-1] == '\n') ) cmdline[--cmdline_size] = '\0';
+  printk("Kernel cmdline size: %lu\n", (unsigned long) cmdline_size);
+  printk("Kernel cmdline: \"%s\"\n", cmdline);
 
- /* generic nv pair kernel cmdline processing finished
-  *  now, examine specific params for defaults and correctness */
+  /* one pass over the line; values are terminated in place */
+  args = cmdline;
+  while( PARAM_BLANK(*args) ) args++;
+  while( *args != '\0' ) {
+    args = param_next(args, &name, &val);
+    /* the rest of the line is for init, not for the kernel */
+    if( (val == NULL) && (strcmp(name, "--") == 0) ) break;
+    i = param_lookup(name);
+    if( i < 0 ) {
+      if( strchr(name, '.') == NULL ) continue;
+      if( nmodparam == MODPARAM_MAX ) {
+        printk(KERN_WARNING "Kernel parameter %s: more than %d module parameters; ignored.\n", name, MODPARAM_MAX);
+        continue;
+      }
+      modparam[nmodparam].name = name;
+      modparam[nmodparam++].val = val;
+      continue;
+    }
+    if( val == NULL ) {
+      if( param[i].req != PARAM_FLAG ) {
+        printk(KERN_WARNING "Kernel parameter %s: value missing.\n", param[i].n);
+        continue;
+      }
+      val = "";
+    } else if( (*val == '\0') && (param[i].req != PARAM_FLAG) ) {
+      printk(KERN_WARNING "Kernel parameter %s: value missing.\n", param[i].n);
+      continue;
+    }
+    param[i].v = val;
+    param[i].src = PARAM_SRC_CMDLINE;
+  }
 
- /* param[irootfstype]: can be checked against /proc/filesystems: */ 
- fd = open("/proc/filesystems", O_RDONLY);
- if( fd == -1 ) {
-   printk("Cannot open /proc/filesystems: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- }
- miscproc_size = read(fd, miscproc_buff, 4095);
- if( miscproc_size == -1 ) {
-   printk("Failed to read /proc/filesystems: %s\n", strerror(errno));
-   return EX_UNAVAILABLE;
- }
- close(fd);
- if( strstr(miscproc_buff, param[irootfstype].v) == NULL ) {
-   printk("%s \"%s\": filesystem type not available.\n", param[irootfstype].n, param[irootfstype].v);
-   return EX_UNAVAILABLE;
- }
+  /* set defaults for params not given on cmdline */
+  for( i=iroot; i<ilastparam; i++ ) {
+    if( param[i].v == NULL ) {
+      param[i].src = PARAM_SRC_DEFAULT;
+      if( param[i].req == PARAM_REQ_YES ) flag_param_missing = 1;
+      param[i].v = param[i].def;
+    }
+    if(param[i].src == PARAM_SRC_DEFAULT) src_msg = "default";
+    else src_msg = "cmdline";
+    if( param[i].v != NULL ) printk("Using %s=\"%s\" (source: %s)\n", param[i].n, param[i].v, src_msg);
+  }
+
+  if( flag_param_missing ) {
+    printk(KERN_ERR "Aborting boot process: missing required kernel parameter(s).\n");
+    return EX_USAGE;
+  }
+
+  /* param[irootfstype]: a root= that is no path can only be a zfs dataset */
+  if( (strcmp(param[irootfstype].v, "auto") == 0) && (param[iroot].v[0] != '/') && (blkid_tag(param[iroot].v) < 0) ) {
+    printk("rootfstype=auto: %s is not a device; taking it for a zfs dataset.\n", param[iroot].v);
+    param[irootfstype].v = "zfs";
+  }
+
+  /* param[iinit_loglevel]: like loglevel=, log only messages below this level */
+  i = atoi(param[iinit_loglevel].v);
+  if( (i < 1) || (i > 8) ) {
+    printk(KERN_WARNING "%s=\"%s\": invalid parameter value; defaulting to \"8\".\n", param[iinit_loglevel].n, param[iinit_loglevel].v);
+    i = 8;
+  }
+  klog_set_threshold(i);
+
+  /* param[ibootreadahead]: record or replay; see ra_start() */
+  if( (param[ibootreadahead].v != NULL) && (strcmp(param[ibootreadahead].v, "record") != 0) && (strcmp(param[ibootreadahead].v, "replay") != 0) ) {
+    printk(KERN_WARNING "%s=\"%s\": invalid parameter value; no readahead.\n", param[ibootreadahead].n, param[ibootreadahead].v);
+    param[ibootreadahead].v = NULL;
+  }
+  i = atoi(param[ibootreadahead_time].v);
+  if( (i < 1) || (i > 600) ) {
+    printk(KERN_WARNING "%s=\"%s\": invalid parameter value; defaulting to \"30\".\n", param[ibootreadahead_time].n, param[ibootreadahead_time].v);
+    param[ibootreadahead_time].v = "30";
+  }
+  return 0;
+}
+
+/* param[imodules_load] and MODULES_MANIFEST: load kernel modules */
+static int stage_modules(void* arg) {
+  struct utsname uts;
+  char path[256];
+  char* req[MODULES_MAX];
+  char* reqopts[MODULES_MAX];
+  char* manifest;
+  char* dep = NULL;
+  char* builtin = NULL;
+  char* line;
+  char* next;
+  char* name;
+  char* val;
+  char* save = NULL;
+  struct mod* m = NULL;
+  struct dag_node* node = NULL;
+  size_t size, builtin_size = 0;
+  int nreq = 0, nmod = 0, nnodes = 0, i, r, ret = 0;
+
+  if( param[imodules_load].v != NULL )
+    for( name = strtok_r(param[imodules_load].v, ",", &save); (name != NULL) && (nreq < MODULES_MAX); name = strtok_r(NULL, ",", &save) ) {
+      req[nreq] = name;
+      reqopts[nreq++] = NULL;
+    }
+  manifest = read_proc_file(MODULES_MANIFEST, NULL);
+  for( line = manifest; (line != NULL) && (*line != '\0'); line = next ) {
+    next = line + strcspn(line, "\n");
+    if( *next != '\0' ) *next++ = '\0';
+    line[strcspn(line, "#")] = '\0';
+    while( PARAM_BLANK(*line) ) line++;
+    if( (*line == '\0') || (nreq == MODULES_MAX) ) continue;
+    req[nreq] = line;
+    line += strcspn(line, " \t");
+    if( *line != '\0' ) *line++ = '\0';
+    while( PARAM_BLANK(*line) ) line++;
+    reqopts[nreq++] = (*line != '\0') ? line : NULL;
+  }
+  if( nreq == 0 ) {
+    free(manifest);
+    return 0;
+  }
+
+  uname(&uts);
+  snprintf(path, sizeof(path), MODULES_DIR "/%s", uts.release);
+  mod_dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if( mod_dirfd == -1 ) {
+    printk(KERN_ERR "modules: %s: %s\n", path, strerror(errno));
+    ret = EX_OSFILE;
+    goto out;
+  }
+  snprintf(path, sizeof(path), MODULES_DIR "/%s/modules.dep", uts.release);
+  dep = read_proc_file(path, &size);
+  if( dep == NULL ) {
+    printk(KERN_ERR "modules: %s: %s\n", path, strerror(errno));
+    ret = EX_OSFILE;
+    goto out;
+  }
+  snprintf(path, sizeof(path), MODULES_DIR "/%s/modules.builtin", uts.release);
+  builtin = read_proc_file(path, &builtin_size);
+  for( i=0; (size_t) i < builtin_size; i++ ) if( builtin[i] == '\n' ) builtin[i] = '\0';
+
+  /* modules.dep: "path: needed-path needed-path ..." */
+  for( line = dep, i = 1; *line != '\0'; line++ ) if( *line == '\n' ) i++;
+  m = calloc(i, sizeof(*m));
+  if( m == NULL ) {
+    ret = EX_OSERR;
+    goto out;
+  }
+  for( line = dep; *line != '\0'; line = next ) {
+    next = line + strcspn(line, "\n");
+    if( *next != '\0' ) *next++ = '\0';
+    val = strchr(line, ':');
+    if( val == NULL ) continue;
+    *val++ = '\0';
+    m[nmod].path = line;
+    m[nmod].deps = val;
+    m[nmod++].node = -1;
+  }
+
+  for( r=0; r<nreq; r++ ) {
+    i = mod_find(m, nmod, req[r], strlen(req[r]));
+    if( i < 0 ) {
+      if( (builtin != NULL) && mod_builtin(builtin, builtin_size, req[r]) ) {
+        printk("modules: %s is built into the kernel.\n", req[r]);
+        continue;
+      }
+      printk(KERN_ERR "modules: %s: not found in modules.dep.\n", req[r]);
+      ret = EX_UNAVAILABLE;
+      continue;
+    }
+    if( reqopts[r] != NULL ) mod_add_opts(&m[i].opts, reqopts[r], NULL);
+    if( mod_want(m, nmod, i, &nnodes) != 0 ) {
+      ret = EX_OSERR;
+      goto out;
+    }
+  }
+
+  /* <module>.<param>=<value> on the kernel command line */
+  for( r=0; r<nmodparam; r++ ) {
+    name = modparam[r].name;
+    next = strchr(name, '.');
+    i = mod_find(m, nmod, name, next - name);
+    if( (i >= 0) && (m[i].node >= 0) ) mod_add_opts(&m[i].opts, next + 1, modparam[r].val);
+  }
+
+  node = calloc(nnodes + 1, sizeof(*node));
+  if( node == NULL ) {
+    ret = EX_OSERR;
+    goto out;
+  }
+  for( i=0; i<nmod; i++ ) {
+    if( m[i].node < 0 ) continue;
+    node[m[i].node].name = mod_basename(m[i].path);
+    node[m[i].node].run = mod_load;
+    node[m[i].node].arg = &m[i];
+    node[m[i].node].deps = m[i].dep;
+    node[m[i].node].ndeps = m[i].ndep;
+    node[m[i].node].flags = DAG_UNTIMED;
+  }
+  printk("modules: loading %d modules for %d requested.\n", nnodes, nreq);
+  r = dag_run(node, nnodes, DAG_THREADS);
+  if( ret == 0 ) ret = r;
+
+out:
+  for( i=0; i<nmod; i++ ) {
+    free(m[i].opts);
+    free(m[i].dep);
+  }
+  free(node);
+  free(m);
+  free(builtin);
+  free(dep);
+  free(manifest);
+  if( mod_dirfd != -1 ) close(mod_dirfd);
+  mod_dirfd = -1;
+  return ret;
+}
+
+/* is type in /proc/filesystems, whose lines have been NUL-terminated? */
+static int fs_available(const char* list, size_t size, const char* type) {
+  const char* line;
+  const char* name;
+
+  for( line = list; line < list + size; line += strlen(line) + 1 ) {
+    /* "nodev\tproc" or "\text4" */
+    name = strrchr(line, '\t');
+    name = (name == NULL) ? line : name + 1;
+    if( strcmp(name, type) == 0 ) return 1;
+  }
+  return 0;
+}
+
+/* /proc/filesystems, its lines NUL-terminated; NULL on failure, logged */
+static char* fs_list(size_t* size) {
+  char* list;
+  size_t i;
+
+  list = read_proc_file("/proc/filesystems", size);
+  if( list == NULL ) {
+    printk(KERN_ERR "Failed to read /proc/filesystems: %s\n", strerror(errno));
+    return NULL;
+  }
+  for( i=0; i<*size; i++ ) if( list[i] == '\n' ) list[i] = '\0';
+  return list;
+}
+
+/* param[irootfstype]=auto: read the type off the root device. Only this
+ *  holds up root_prepare; an explicit type goes straight on to it */
+static int stage_fs_probe(void* arg) {
+  const char* type;
+  char* list;
+  size_t size;
+  int ret = 0;
+
+  if( strcmp(param[irootfstype].v, "auto") != 0 ) return 0;
+  list = fs_list(&size);
+  if( list == NULL ) return EX_UNAVAILABLE;
+
+  type = fsprobe(param[iroot].v, NULL);
+  if( type == NULL ) {
+    printk(KERN_ERR "rootfstype=auto: cannot identify the filesystem on %s: %s\n", param[iroot].v, strerror(errno));
+    ret = EX_UNAVAILABLE;
+    goto out;
+  }
+  if( strcmp(type, "zfs") == 0 ) {
+    printk(KERN_ERR "rootfstype=auto: %s belongs to a zfs pool; give root=<pool>/<dataset>.\n", param[iroot].v);
+    ret = EX_USAGE;
+    goto out;
+  }
+  /* the ext4 driver mounts ext2 and ext3 too */
+  if( (strncmp(type, "ext", 3) == 0) && !fs_available(list, size, type) && fs_available(list, size, "ext4") ) type = "ext4";
+  printk("rootfstype=auto: %s has a %s filesystem.\n", param[iroot].v, type);
+  param[irootfstype].v = (char*) type;
+out:
+  free(list);
+  return ret;
+}
+
+/* param[irootfstype] is checked against /proc/filesystems while
+ *  root_prepare runs; mount_root waits for both */
+static int stage_fs_check(void* arg) {
+  char* list;
+  size_t size;
+  int ret = 0;
+
+  list = fs_list(&size);
+  if( list == NULL ) return EX_UNAVAILABLE;
+  if( !fs_available(list, size, param[irootfstype].v) ) {
+    printk(KERN_ERR "%s=\"%s\": filesystem type not available.\n", param[irootfstype].n, param[irootfstype].v);
+    ret = EX_UNAVAILABLE;
+  }
+  free(list);
+  return ret;
+}
 
- /* zfs-specific */
- if( strcmp(param[irootfstype].v, "zfs") == 0 ) {
-   if( access("/etc/zfs/zpool.cache", F_OK) == 0 )
-     printk("rootfstype=%s: /etc/zfs/zpool.cache is present in initramfs.\n", param[irootfstype].v);
-   else
-     printk("rootfstype=%s: /etc/zfs/zpool.cache not present in initramfs.\n", param[irootfstype].v);
+/* zfs-specific */
+static int stage_zfs_check(void* arg) {
+  if( strcmp(param[irootfstype].v, "zfs") != 0 ) return 0;
 
-   if( access("/etc/hostid", F_OK) == 0 )
-     printk("rootfstype=%s: /etc/hostid is present in initramfs.\n", param[irootfstype].v);
-   else
-     printk("rootfstype=%s: /etc/hostid not present in initramfs.\n", param[irootfstype].v);
+  if( access("/etc/zfs/zpool.cache", F_OK) == 0 )
+    printk("rootfstype=%s: /etc/zfs/zpool.cache is present in initramfs.\n", param[irootfstype].v);
+  else
+    printk("rootfstype=%s: /etc/zfs/zpool.cache not present in initramfs.\n", param[irootfstype].v);
+
+  if( access("/etc/hostid", F_OK) == 0 )
+    printk("rootfstype=%s: /etc/hostid is present in initramfs.\n", param[irootfstype].v);
+  else
+    printk("rootfstype=%s: /etc/hostid not present in initramfs.\n", param[irootfstype].v);
+  return 0;
+}
 
 #if defined(INCLUDE_ZPOOL_IMPORT)
-   /* zpool import */
-   if( (param[izpool_import_name].v != NULL) || (param[izpool_import_guid].v != NULL) ) {
+/*** zprobe: parallel vdev label prober for zpool import
+ *
+ * Left to itself zpool_search_import() opens every device in /dev one after
+ * the other. zprobe instead reads the vdev label of each candidate device on
+ * ZPROBE_THREADS threads and keeps the devices that belong to the requested
+ * pool. The label of a vdev holds the vdev tree of its top-level vdev and the
+ * pool's vdev_children, so the scan can stop as soon as every top-level vdev
+ * and every leaf under them has been seen. libzfs is then handed only those
+ * devices to assemble the pool config from.
+ *
+ * Candidates are the zpool_import_devices= list, else the entries of the
+ * zpool_import_dir= directories, else every device in /sys/class/block.
+ */
+#define ZPROBE_THREADS 16
+#define ZPROBE_MAXDEV  1024
+#define ZPROBE_MAXDIRS 16
+#define ZPROBE_NVLIST_OFFSET (16 * 1024)       /* after blank space and boot header */
+#define ZPROBE_NVLIST_SIZE   (112 * 1024 - 40) /* vdev_phys_t less its zio_eck_t */
+#define ZPROBE_LABEL_SIZE    (256 * 1024)
+
+struct zprobe_guids { uint64_t g[ZPROBE_MAXDEV]; int n; };
+
+struct zprobe {
+  char* dev[ZPROBE_MAXDEV];   /* candidate device paths */
+  int ndev;
+  int next;                   /* next candidate to probe */
+  const char* name;           /* pool wanted, by name ... */
+  uint64_t guid;              /* ... or by guid */
+  uint64_t pool_guid;         /* pool found; 0 until the first match */
+  int ambiguous;              /* more than one pool has that name */
+  uint64_t children;          /* top-level vdevs of the pool */
+  struct zprobe_guids top;    /* top-level vdevs seen */
+  struct zprobe_guids need;   /* leaves of the top-level vdevs seen */
+  struct zprobe_guids have;   /* leaves found */
+  char* match[ZPROBE_MAXDEV]; /* devices of the pool */
+  int nmatch;
+  int complete;
+  pthread_mutex_t lock;
+};
+
+/* adds guid to the set; returns 1 if it was not there */
+static int zprobe_guid_add(struct zprobe_guids* s, uint64_t guid) {
+  int i;
+
+  for( i=0; i<s->n; i++ ) if( s->g[i] == guid ) return 0;
+  if( s->n == ZPROBE_MAXDEV ) return 0;
+  s->g[s->n++] = guid;
+  return 1;
+}
+
+static int zprobe_guid_has(struct zprobe_guids* s, uint64_t guid) {
+  int i;
+
+  for( i=0; i<s->n; i++ ) if( s->g[i] == guid ) return 1;
+  return 0;
+}
+
+static void zprobe_add_dev(struct zprobe* zp, const char* dir, const char* name) {
+  char* path;
+
+  if( zp->ndev == ZPROBE_MAXDEV ) return;
+  if( (dir == NULL) && (name[0] == '/') ) dir = "";
+  else if( dir == NULL ) dir = "/dev/";
+  path = malloc(strlen(dir) + strlen(name) + 2);
+  if( path == NULL ) return;
+  snprintf(path, strlen(dir) + strlen(name) + 2, "%s%s%s", dir, ((dir[0] == '\0') || (dir[strlen(dir)-1] == '/')) ? "" : "/", name);
+  zp->dev[zp->ndev++] = path;
+}
+
+/* blockdev_match_fn that collects every device instead of matching one */
+static int zprobe_add_blockdev(const char* devname, void* arg) {
+  if( blockdev_slow(devname) ) return 0;
+  zprobe_add_dev((struct zprobe*) arg, NULL, devname);
+  return 0;
+}
+
+/* splits a comma-separated list in place */
+static int zprobe_split(char* list, char** out, int max) {
+  char* save = NULL;
+  char* t;
+  int n = 0;
+
+  for( t = strtok_r(list, ",", &save); (t != NULL) && (n < max); t = strtok_r(NULL, ",", &save) ) out[n++] = t;
+  return n;
+}
+
+static void zprobe_add_dir(struct zprobe* zp, const char* dir) {
+  DIR* d;
+  struct dirent* de;
+
+  d = opendir(dir);
+  if( d == NULL ) {
+    printk(KERN_WARNING "zpool_import: cannot open %s: %s\n", dir, strerror(errno));
+    return;
+  }
+  while( (de = readdir(d)) != NULL ) {
+    if( de->d_name[0] == '.' ) continue;
+    if( (de->d_type != DT_BLK) && (de->d_type != DT_LNK) && (de->d_type != DT_UNKNOWN) ) continue;
+    zprobe_add_dev(zp, dir, de->d_name);
+  }
+  closedir(d);
+}
+
+/* reads the config nvlist of label 0, or of label 1 if label 0 is damaged */
+static nvlist_t* zprobe_label(const char* path) {
+  nvlist_t* config = NULL;
+  char* buf;
+  int fd, l;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return NULL;
+  buf = malloc(ZPROBE_NVLIST_SIZE);
+  for( l=0; (buf != NULL) && (l < 2) && (config == NULL); l++ ) {
+    if( pread(fd, buf, ZPROBE_NVLIST_SIZE, (off_t) l*ZPROBE_LABEL_SIZE + ZPROBE_NVLIST_OFFSET) != ZPROBE_NVLIST_SIZE ) break;
+    if( nvlist_unpack(buf, ZPROBE_NVLIST_SIZE, &config, 0) != 0 ) config = NULL;
+  }
+  free(buf);
+  close(fd);
+  return config;
+}
+
+static void zprobe_leaves(struct zprobe* zp, nvlist_t* tree) {
+  nvlist_t** child;
+  uint_t nchild, i;
+  uint64_t guid;
+
+  if( nvlist_lookup_nvlist_array(tree, ZPOOL_CONFIG_CHILDREN, &child, &nchild) == 0 ) {
+    for( i=0; i<nchild; i++ ) zprobe_leaves(zp, child[i]);
+  } else if( nvlist_lookup_uint64(tree, ZPOOL_CONFIG_GUID, &guid) == 0 ) {
+    zprobe_guid_add(&zp->need, guid);
+  }
+}
+
+/* call with zp->lock held */
+static int zprobe_complete(struct zprobe* zp) {
+  int i;
+
+  if( zp->ambiguous || (zp->children == 0) || ((uint64_t) zp->top.n < zp->children) ) return 0;
+  for( i=0; i<zp->need.n; i++ ) if( !zprobe_guid_has(&zp->have, zp->need.g[i]) ) return 0;
+  return 1;
+}
+
+static void zprobe_dev(struct zprobe* zp, char* path) {
+  nvlist_t* config;
+  nvlist_t* tree = NULL;
+  char* name;
+  uint64_t state, pool_guid, guid, top_guid = 0, children = 0;
+
+  config = zprobe_label(path);
+  if( config == NULL ) return;
+  /* spares and cache devices carry no pool guid */
+  if( (nvlist_lookup_uint64(config, ZPOOL_CONFIG_POOL_STATE, &state) != 0) || (state == POOL_STATE_DESTROYED) ||
+      (nvlist_lookup_uint64(config, ZPOOL_CONFIG_POOL_GUID, &pool_guid) != 0) ||
+      (nvlist_lookup_string(config, ZPOOL_CONFIG_POOL_NAME, &name) != 0) ||
+      (nvlist_lookup_uint64(config, ZPOOL_CONFIG_GUID, &guid) != 0) ) goto out;
+  if( (zp->guid != 0) ? (pool_guid != zp->guid) : (strcmp(name, zp->name) != 0) ) goto out;
+  nvlist_lookup_uint64(config, ZPOOL_CONFIG_TOP_GUID, &top_guid);
+  nvlist_lookup_uint64(config, ZPOOL_CONFIG_VDEV_CHILDREN, &children);
+  nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &tree);
+
+  pthread_mutex_lock(&zp->lock);
+  if( zp->pool_guid == 0 ) zp->pool_guid = pool_guid;
+  else if( zp->pool_guid != pool_guid ) zp->ambiguous = 1;
+  zp->match[zp->nmatch++] = path;
+  zprobe_guid_add(&zp->have, guid);
+  if( children > zp->children ) zp->children = children;
+  if( (top_guid != 0) && zprobe_guid_add(&zp->top, top_guid) && (tree != NULL) ) zprobe_leaves(zp, tree);
+  if( zprobe_complete(zp) ) zp->complete = 1;
+  pthread_mutex_unlock(&zp->lock);
+out:
+  nvlist_free(config);
+}
+
+static void* zprobe_worker(void* arg) {
+  struct zprobe* zp = arg;
+  int i;
+
+  for(;;) {
+    pthread_mutex_lock(&zp->lock);
+    if( zp->complete || (zp->next == zp->ndev) ) {
+      pthread_mutex_unlock(&zp->lock);
+      return NULL;
+    }
+    i = zp->next++;
+    pthread_mutex_unlock(&zp->lock);
+    zprobe_dev(zp, zp->dev[i]);
+  }
+}
+
+/* probes the candidates; returns the number of devices of the pool found */
+static int zprobe_run(struct zprobe* zp) {
+  pthread_t th[ZPROBE_THREADS];
+  int i, n;
+
+  pthread_mutex_init(&zp->lock, NULL);
+  for( n=0; (n < ZPROBE_THREADS) && (n < zp->ndev); n++ )
+    if( pthread_create(&th[n], NULL, zprobe_worker, zp) != 0 ) break;
+  if( n == 0 ) zprobe_worker(zp);
+  for( i=0; i<n; i++ ) pthread_join(th[i], NULL);
+  pthread_mutex_destroy(&zp->lock);
+  return zp->nmatch;
+}
+
+static void zprobe_free(struct zprobe* zp) {
+  int i;
+
+  for( i=0; i<zp->ndev; i++ ) free(zp->dev[i]);
+  free(zp);
+}
+
+/* kept open for stage_zfs_mount */
+static libzfs_handle_t* zpool_libzfs = NULL;
+
+/* zpool import */
+static int stage_zpool_import(void* arg) {
+	libzfs_handle_t* libzfs = NULL;
+	importargs_t iargs = { 0 };
+	nvlist_t* pools = NULL;
+	nvpair_t* pool = NULL;
+	nvlist_t* config = NULL;
+	struct zprobe* zp = NULL;
+	char* dirs[ZPROBE_MAXDIRS];
+	char* dev;
+	char* save = NULL;
+	int ndirs = 0, ndevs = 0, i, tl;
+
+	if( strcmp(param[irootfstype].v, "zfs") != 0 ) return 0;
+	if( (param[izpool_import_name].v == NULL) && (param[izpool_import_guid].v == NULL) ) return 0;
+
 	printk("zpool_import: import requested.\n");
 	if( (param[izpool_import_name].v != NULL) && (param[izpool_import_guid].v != NULL) ) {
 		printk("zpool_import: given both pool name and guid; using guid.\n");
@@ -380,13 +3696,59 @@ int main(int argc, char* argv[]) {
 	iargs.unique = 1;
 	iargs.exists = 1;
 
+	/* param[izpool_import_dir], param[izpool_import_devices]: comma-separated
+	 *  directories to search, or devices to probe, instead of all of /dev */
+	if( param[izpool_import_dir].v != NULL )
+		ndirs = zprobe_split(param[izpool_import_dir].v, dirs, ZPROBE_MAXDIRS);
+	zp = calloc(1, sizeof(*zp));
+	if( zp != NULL ) {
+		zp->name = iargs.poolname;
+		zp->guid = iargs.guid;
+		if( param[izpool_import_devices].v != NULL ) {
+			for( dev = strtok_r(param[izpool_import_devices].v, ",", &save); dev != NULL; dev = strtok_r(NULL, ",", &save) )
+				zprobe_add_dev(zp, NULL, dev);
+			ndevs = zp->ndev;
+		} else if( ndirs > 0 ) {
+			for( i=0; i<ndirs; i++ ) zprobe_add_dir(zp, dirs[i]);
+		} else	blockdev_scan(zprobe_add_blockdev, zp);
+		printk("zpool_import: probing labels of %d devices.\n", zp->ndev);
+		tl = timeline_begin("zpool_probe");
+		zprobe_run(zp);
+		timeline_end(tl);
+		printk("zpool_import: probed %d devices, %d belong to the pool%s.\n", zp->next, zp->nmatch,
+			zp->complete ? "; all vdevs found" : "");
+	}
+
 	printk("zpool_import: init libzfs.\n");
 	libzfs = libzfs_init();
 	if( libzfs != NULL ) {
 		printk("zpool_import: searching for pool.\n");
-		pools = zpool_search_import(libzfs, &iargs);
+		tl = timeline_begin("zpool_search");
+		if( (zp != NULL) && (zp->nmatch > 0) ) {
+			iargs.path = zp->match;
+			iargs.paths = zp->nmatch;
+			pools = zpool_search_import(libzfs, &iargs);
+			/* libzfs before 0.8 takes only directories in iargs.path */
+			if( (pools != NULL) && nvlist_empty(pools) ) {
+				nvlist_free(pools);
+				pools = NULL;
+			}
+			if( pools == NULL )
+				printk(KERN_WARNING "zpool_import: pool not assembled from probed devices; searching again.\n");
+		}
+		if( pools == NULL ) {
+			if( (zp != NULL) && (ndevs > 0) ) {
+				iargs.path = zp->dev;
+				iargs.paths = zp->ndev;
+			} else {
+				iargs.path = (ndirs > 0) ? dirs : NULL;
+				iargs.paths = ndirs;
+			}
+			pools = zpool_search_import(libzfs, &iargs);
+		}
+		timeline_end(tl);
 		if( (pools == NULL) || nvlist_empty(pools) )
-			printk("zpool_import: pool not available for import, or already imported by cachefile.\n");
+			printk(KERN_WARNING "zpool_import: pool not available for import, or already imported by cachefile.\n");
 		else {
 			printk("zpool_import: getting pool information.\n");
 			pool = nvlist_next_nvpair(pools, pool);
@@ -394,118 +3756,1025 @@ int main(int argc, char* argv[]) {
 			nvpair_value_nvlist(pool, &config);
 			printk("zpool_import: attempting pool import.\n");
 			if( zpool_import(libzfs, config, param[izpool_import_newname].v, NULL) != 0 ) {
-				printk("zpool_import: import failed.\n");
-				printk("zpool_import: error description: %s\n", libzfs_error_description(libzfs) );
-				printk("zpool_import: error action: %s\n", libzfs_error_action(libzfs) );
+				printk(KERN_ERR "zpool_import: import failed.\n");
+				printk(KERN_ERR "zpool_import: error description: %s\n", libzfs_error_description(libzfs) );
+				printk(KERN_ERR "zpool_import: error action: %s\n", libzfs_error_action(libzfs) );
 			} else  printk("zpool_import: import successful.\n");
 		}
-		printk("zpool_import: fini libzfs.\n");
-		libzfs_fini(libzfs);
+		zpool_libzfs = libzfs;
 	} else {
-		printk("zpool_import: unable to initialize libzfs.\n");
+		printk(KERN_ERR "zpool_import: unable to initialize libzfs.\n");
 	}
-   }
+	if( zp != NULL ) zprobe_free(zp);
+	return 0;
+}
 #endif /* zpool_import */
- }
 
- if(      strcmp(param[imountopt].v, "ro") == 0 ) mountflags = MS_RDONLY;
- else if( strcmp(param[imountopt].v, "rw") == 0 ) mountflags = 0;
- else {
-   printk("%s \"%s\": invalid parameter value; defaulting to \"ro\".\n", param[imountopt].n, param[imountopt].v);
-   mountflags = MS_RDONLY;
- }
+/* param[iroot]: nothing to check; if user gives bad root=device then mount fails */
 
- /* param[iroot]: nothing to check; if user gives bad root=device then mount fails */
+/* param[iroot]: UUID=, LABEL=, PARTUUID= and PARTLABEL= name a device by tag;
+ *  param[irootwait], param[irootdelay]: wait for a /dev root device to appear
+ *  rootwait waits without limit, rootwait=<sec> and rootdelay=<sec> up to <sec>;
+ *  unlike the kernel's rootdelay, the wait ends as soon as the device is there */
+static char root_dev[64]; /* root= resolved from a tag */
 
- /* try to mount root=device at /mnt
-  *
-  * note: for zfs, if a copy of /etc/zfs/zpool.cache (when pool is imported) is put in initramfs-source, then
-  * the zfs module can read it and automatically import the pools described in the cache file; the imported
-  * pools can be available to mount here if they were created using standard device names, otherwise
-  * udevd may be required to run before mounting the pool */
- printk("Attempting cmd: mount -t %s -o %s %s /mnt.\n", param[irootfstype].v, param[imountopt].v, param[iroot].v);
- if( mount(param[iroot].v, "/mnt", param[irootfstype].v, mountflags, NULL) != 0 ) {
-  printk("time to panic: mount: %s\n", strerror(errno));
-  return EX_UNAVAILABLE;
- }
- printk("%s mounted successfully.\n", param[iroot].v);
+static int stage_root_wait(void* arg) {
+  long timeout_ms = -1;
+  char* endp;
+  int tag = blkid_tag(param[iroot].v);
+  int wait = (param[irootwait].src == PARAM_SRC_CMDLINE) || (param[irootdelay].src == PARAM_SRC_CMDLINE);
 
- /* check to see if the mounted root filesystem has an executable init program */
- chdir("/mnt");
- if( access(param[iinit].v+1, X_OK) != 0 ) {
-   chdir("/");
-   printk("access X_OK: %s\n", strerror(errno));
-   printk("The init program /mnt/%s is not present or not executable.\n", param[iinit].v+1);
-   printk("Aborting boot process: no init program.\n");
-   printk("Unmounting %s.\n", param[iroot].v);
-   if( umount("/mnt") == -1 ) {
-     printk("umount: %s\n", strerror(errno));
-     printk("Failed to umount %s.\n", param[iroot].v);
-   } else printk("Successfully unmounted %s.\n", param[iroot].v);
-   return EX_UNAVAILABLE;
- }
- chdir("/");
- printk("Init program /mnt/%s is present and executable.\n", param[iinit].v+1);
+  if( tag >= 0 ) {
+    if( blkid_resolve(param[iroot].v, root_dev, sizeof(root_dev)) == 0 ) {
+      printk("root=%s is %s.\n", param[iroot].v, root_dev);
+      param[iroot].v = root_dev;
+      return 0;
+    }
+    if( errno == ENOTUNIQ ) return EX_USAGE;
+    if( !wait ) {
+      printk(KERN_ERR "root=%s: no such block device.\n", param[iroot].v);
+      blockdev_list();
+      return EX_UNAVAILABLE;
+    }
+  }
+  if( !wait ) return 0;
+  if( param[irootwait].src == PARAM_SRC_CMDLINE ) endp = param[irootwait].v;
+  else endp = param[irootdelay].v;
+  if( *endp != '\0' ) {
+    timeout_ms = param_ms(endp);
+    if( timeout_ms < 0 ) {
+      printk(KERN_WARNING "rootwait: invalid timeout; waiting without limit.\n");
+      timeout_ms = -1;
+    }
+  }
+  if( (tag < 0) && (strncmp(param[iroot].v, "/dev/", 5) != 0) ) {
+    printk("rootwait: %s is not a /dev block device; not waiting.\n", param[iroot].v);
+    return 0;
+  }
+  if( timeout_ms < 0 ) printk("rootwait: waiting for %s.\n", param[iroot].v);
+  else printk("rootwait: waiting up to %ld ms for %s.\n", timeout_ms, param[iroot].v);
+  klog_flush();
+  if( ((tag >= 0) && (blockdev_wait(blkid_match_blockdev, param[iroot].v, timeout_ms) != 0)) ||
+      ((tag < 0) && (blockdev_wait(blockdev_match_name, param[iroot].v + 5, timeout_ms) != 0)) ) {
+    printk(KERN_ERR "rootwait: root device %s did not appear within %ld ms.\n", param[iroot].v, timeout_ms);
+    blockdev_list();
+    printk(KERN_ERR "Aborting boot process: no root device.\n");
+    return EX_UNAVAILABLE;
+  }
+  printk("rootwait: %s is present.\n", param[iroot].v);
+  if( tag >= 0 ) {
+    if( blkid_resolve(param[iroot].v, root_dev, sizeof(root_dev)) != 0 ) {
+      if( errno == ENOTUNIQ ) return EX_USAGE;
+      printk(KERN_ERR "root=%s: no such block device.\n", param[iroot].v);
+      return EX_UNAVAILABLE;
+    }
+    printk("root=%s is %s.\n", param[iroot].v, root_dev);
+    param[iroot].v = root_dev;
+  }
+  return 0;
+}
+
+/* param[iresume], param[iresume_offset], param[iresumewait]: hand a
+ *  hibernation image to the kernel before any filesystem is mounted
+ *  read-write or a pool imported, as the kernel's own resume= would.
+ *  resume= is a device, a UUID=/LABEL=/PARTUUID=/PARTLABEL= tag or
+ *  <major>:<minor>; for a swap file it is the device of the filesystem that
+ *  holds it, and resume_offset= the file's first page on that device.
+ *  A plain swap signature there means no image, and the boot goes on without
+ *  asking the kernel. Otherwise the device goes to RESUME_SYSFS/resume; if
+ *  the kernel finds an image it restores the saved system and the write
+ *  never returns. Nothing here stops the normal boot. */
+#define RESUME_SYSFS "/sys/power"
+
+static int resume_write(const char* name, const char* value) {
+  char path[64];
+  int fd, ret;
+
+  snprintf(path, sizeof(path), "%s/%s", RESUME_SYSFS, name);
+  fd = open(path, O_WRONLY | O_CLOEXEC);
+  if( fd == -1 ) return -1;
+  ret = (write(fd, value, strlen(value)) == (ssize_t) strlen(value)) ? 0 : -1;
+  close(fd);
+  return ret;
+}
+
+static int stage_resume(void* arg) {
+  static char dev[64];
+  char devnum[24];
+  char sig[10];
+  char* endp;
+  struct stat st;
+  unsigned long long offset = 0;
+  unsigned long maj, min;
+  long page = sysconf(_SC_PAGESIZE);
+  int fd, tag, found;
+
+  if( param[iresume].v == NULL ) return 0;
+  if( param[iresume_offset].v != NULL ) {
+    offset = strtoull(param[iresume_offset].v, &endp, 10);
+    if( (*endp != '\0') || (param[iresume_offset].v[0] == '\0') ) {
+      printk(KERN_WARNING "%s=\"%s\": invalid parameter value; booting normally.\n", param[iresume_offset].n, param[iresume_offset].v);
+      return 0;
+    }
+  }
+
+  /* <major>:<minor> goes to the kernel as it is */
+  maj = strtoul(param[iresume].v, &endp, 10);
+  if( (endp != param[iresume].v) && (*endp == ':') ) {
+    min = strtoul(endp + 1, &endp, 10);
+    if( *endp != '\0' ) {
+      printk(KERN_WARNING "resume=%s: not a device; booting normally.\n", param[iresume].v);
+      return 0;
+    }
+    snprintf(devnum, sizeof(devnum), "%lu:%lu", maj, min);
+  } else {
+    tag = blkid_tag(param[iresume].v);
+    if( (tag < 0) && (strncmp(param[iresume].v, "/dev/", 5) != 0) ) {
+      printk(KERN_WARNING "resume=%s: not a device; booting normally.\n", param[iresume].v);
+      return 0;
+    }
+    if( tag >= 0 ) found = (blkid_resolve(param[iresume].v, dev, sizeof(dev)) == 0);
+    else found = (snprintf(dev, sizeof(dev), "%s", param[iresume].v) < (int) sizeof(dev)) && (access(dev, F_OK) == 0);
+    if( !found && (param[iresumewait].src == PARAM_SRC_CMDLINE) ) {
+      printk("resumewait: waiting for %s.\n", param[iresume].v);
+      klog_flush();
+      if( tag >= 0 ) found = (blockdev_wait(blkid_match_blockdev, param[iresume].v, -1) == 0) && (blkid_resolve(param[iresume].v, dev, sizeof(dev)) == 0);
+      else found = (blockdev_wait(blockdev_match_name, param[iresume].v + 5, -1) == 0);
+    }
+    if( !found || (stat(dev, &st) != 0) || !S_ISBLK(st.st_mode) ) {
+      printk(KERN_WARNING "resume=%s: no such block device; booting normally.\n", param[iresume].v);
+      return 0;
+    }
+    snprintf(devnum, sizeof(devnum), "%u:%u", major(st.st_rdev), minor(st.st_rdev));
+
+    /* the swap header ends in SWAPSPACE2, or in the signature of an image */
+    fd = open(dev, O_RDONLY | O_CLOEXEC);
+    if( (fd != -1) && (pread(fd, sig, sizeof(sig), offset * page + page - sizeof(sig)) == (ssize_t) sizeof(sig)) &&
+        ((memcmp(sig, "SWAPSPACE2", 10) == 0) || (memcmp(sig, "SWAP-SPACE", 10) == 0)) ) {
+      close(fd);
+      printk("resume=%s: no hibernation image on %s; booting normally.\n", param[iresume].v, dev);
+      return 0;
+    }
+    if( fd != -1 ) close(fd);
+  }
+
+  printk(KERN_NOTICE "Resuming from hibernation image on %s (offset %llu).\n", devnum, offset);
+  klog_flush();
+  snprintf(dev, sizeof(dev), "%llu", offset);
+  if( ((offset > 0) && (resume_write("resume_offset", dev) != 0)) || (resume_write("resume", devnum) != 0) ) {
+    printk(KERN_WARNING "%s: %s; booting normally.\n", RESUME_SYSFS, strerror(errno));
+    return 0;
+  }
+  printk("No hibernation image was resumed; booting normally.\n");
+  return 0;
+}
+
+/* param[izram], param[izram_tmp]: compressed swap before the real init
+ *  zram=<size>[,<algorithm>[,<priority>]] hot-adds a zram device, sets its
+ *  compression algorithm and size, writes a swap header on it and swaps on
+ *  it with the given priority (default 100; -1 leaves it to the kernel),
+ *  with discard so freed pages give their memory back. zram_tmp=<dir>[,<size>] mounts a tmpfs at
+ *  ZRAM_TMP, moved to <dir> of the new root along with /dev, /proc and
+ *  /sys; its pages are compressed into the zram swap under memory pressure.
+ *  Sizes take a K, M or G suffix. Runs after resume, so a hibernation image
+ *  is never read with swap in use. */
+#define ZRAM_TMP "/zram_tmp"
+
+static char zram_tmp_dir[256]; /* <dir> of zram_tmp=, or "" */
+
+/* bytes in "512M" and the like, or 0 */
+static unsigned long long zram_size(const char* s) {
+  unsigned long long n;
+  char* endp;
+
+  n = strtoull(s, &endp, 10);
+  if( endp == s ) return 0;
+  switch( *endp ) {
+  case 'G': case 'g': n <<= 10; /* fall through */
+  case 'M': case 'm': n <<= 10; /* fall through */
+  case 'K': case 'k': n <<= 10; endp++;
+  }
+  return ((*endp == '\0') || (*endp == ',')) ? n : 0;
+}
+
+static int zram_sysfs(int id, const char* attr, const char* value) {
+  char path[64];
+  int fd, ret;
+
+  snprintf(path, sizeof(path), "/sys/block/zram%d/%s", id, attr);
+  fd = open(path, O_WRONLY | O_CLOEXEC);
+  if( fd == -1 ) return -1;
+  ret = (write(fd, value, strlen(value)) == (ssize_t) strlen(value)) ? 0 : -1;
+  close(fd);
+  return ret;
+}
+
+/* a new zram device number, or -1 */
+static int zram_add(void) {
+  char buf[16];
+  ssize_t n;
+  int fd;
+
+  fd = open("/sys/class/zram-control/hot_add", O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) {
+    /* no zram-control before 4.2: the module's first device, if unused */
+    fd = open("/sys/block/zram0/disksize", O_RDONLY | O_CLOEXEC);
+    if( fd == -1 ) return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    return ((n > 0) && (buf[0] == '0')) ? 0 : -1;
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if( n <= 0 ) return -1;
+  buf[n] = '\0';
+  return atoi(buf);
+}
+
+/* write a version 1 swap header, as mkswap does */
+static int zram_mkswap(const char* dev, unsigned long long size) {
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned char* hdr;
+  uint32_t info[3];
+  int fd, ret = -1;
+
+  hdr = calloc(1, page);
+  if( hdr == NULL ) return -1;
+  info[0] = 1;                          /* version */
+  info[1] = (uint32_t) (size / page - 1); /* last_page */
+  info[2] = 0;                          /* nr_badpages */
+  memcpy(hdr + 1024, info, sizeof(info));
+  memcpy(hdr + 1024 + sizeof(info) + 16, "zram", 4); /* after the uuid: the label */
+  memcpy(hdr + page - 10, "SWAPSPACE2", 10);
+  fd = open(dev, O_WRONLY | O_CLOEXEC);
+  if( fd != -1 ) {
+    if( (write(fd, hdr, page) == page) && (fsync(fd) == 0) ) ret = 0;
+    close(fd);
+  }
+  free(hdr);
+  return ret;
+}
+
+static int stage_zram(void* arg) {
+  char dev[32];
+  char value[64];
+  char* algo = NULL;
+  char* prio_s = NULL;
+  char* p;
+  unsigned long long size;
+  int id, prio = 100;
+
+  if( param[izram_tmp].v != NULL ) {
+    snprintf(value, sizeof(value), "mode=1777");
+    p = strchr(param[izram_tmp].v, ',');
+    if( p != NULL ) {
+      *p++ = '\0';
+      if( (size = zram_size(p)) == 0 ) printk(KERN_WARNING "zram_tmp: invalid size \"%s\"; using the tmpfs default.\n", p);
+      else snprintf(value, sizeof(value), "mode=1777,size=%llu", size);
+    }
+    if( (param[izram_tmp].v[0] != '/') || (strlen(param[izram_tmp].v) >= sizeof(zram_tmp_dir)) )
+      printk(KERN_WARNING "zram_tmp=%s: not an absolute path; no scratch tmpfs.\n", param[izram_tmp].v);
+    else if( (mkdir(ZRAM_TMP, 0755) != 0) && (errno != EEXIST) )
+      printk(KERN_WARNING "zram_tmp: mkdir %s: %s\n", ZRAM_TMP, strerror(errno));
+    else if( mnt_mount("tmpfs", ZRAM_TMP, "tmpfs", MS_NOSUID | MS_NODEV, value) != 0 )
+      printk(KERN_WARNING "zram_tmp: mount tmpfs: %s\n", strerror(errno));
+    else {
+      strcpy(zram_tmp_dir, param[izram_tmp].v);
+      printk("Mounted tmpfs (%s) for %s.\n", value, zram_tmp_dir);
+    }
+  }
+
+  if( param[izram].v == NULL ) return 0;
+  /* <size>[,<algorithm>[,<priority>]] */
+  size = zram_size(param[izram].v);
+  algo = strchr(param[izram].v, ',');
+  if( algo != NULL ) {
+    *algo++ = '\0';
+    prio_s = strchr(algo, ',');
+    if( prio_s != NULL ) {
+      *prio_s++ = '\0';
+      prio = strtol(prio_s, &p, 10);
+      if( (p == prio_s) || (*p != '\0') ) prio = -2;
+    }
+  }
+  /* as swapon(8): -1 leaves the priority to the kernel */
+  if( (size == 0) || (prio < -1) || (prio > 32767) ) {
+    printk(KERN_WARNING "zram=%s: invalid parameter value; no zram swap.\n", param[izram].v);
+    return 0;
+  }
+
+  id = zram_add();
+  if( id < 0 ) {
+    printk(KERN_WARNING "zram: no device to set up (is the zram module loaded?): %s\n", strerror(errno));
+    return 0;
+  }
+  snprintf(dev, sizeof(dev), "/dev/zram%d", id);
+  if( (algo != NULL) && (*algo != '\0') && (zram_sysfs(id, "comp_algorithm", algo) != 0) )
+    printk(KERN_WARNING "zram: algorithm %s: %s; using the default.\n", algo, strerror(errno));
+  snprintf(value, sizeof(value), "%llu", size);
+  if( zram_sysfs(id, "disksize", value) != 0 ) {
+    printk(KERN_WARNING "zram: %s: disksize %s: %s\n", dev, value, strerror(errno));
+    return 0;
+  }
+  if( zram_mkswap(dev, size) != 0 ) {
+    printk(KERN_WARNING "zram: %s: writing swap header: %s\n", dev, strerror(errno));
+    return 0;
+  }
+  if( swapon(dev, SWAP_FLAG_DISCARD | ((prio < 0) ? 0 : SWAP_FLAG_PREFER | ((prio << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK))) != 0 ) {
+    printk(KERN_WARNING "zram: swapon %s: %s\n", dev, strerror(errno));
+    return 0;
+  }
+  printk("Swapping on %s: %llu kB, %s, priority %d.\n", dev, size / 1024, ((algo != NULL) && (*algo != '\0')) ? algo : "default algorithm", prio);
+  return 0;
+}
+
+/* param[iboottune], param[iboottune_restore]: sysfs tuning while /init runs
+ *  boottune=<item>[,<item>...], an item being [<dev>:]<attr>=<value>:
+ *  governor= sets the cpufreq governor of every policy; scheduler=,
+ *  read_ahead_kb= and nr_requests= set queue/<attr> of block device <dev>,
+ *  or without <dev> of every block device backed by hardware. Devices are
+ *  tuned once root_wait is done; ones found later are left alone. Each
+ *  value replaced is kept and written back by boottune_restore() just
+ *  before execl(), or, given boottune_restore=<file>, listed in that file
+ *  of the new root as "<path> <value>" lines for the real init to write
+ *  back when it is done booting. Everything is opened relative to a
+ *  directory fd on BOOTTUNE_SYSFS, which outlives the move of /sys. */
+#define BOOTTUNE_SYSFS "/sys"
+#define BOOTTUNE_MAX 64
+
+static const char* const boottune_attr[] = { "governor", "scheduler", "read_ahead_kb", "nr_requests", NULL };
+
+static int boottune_sys = -1;
+static int boottune_n;
+static struct {
+  char path[128]; /* relative to BOOTTUNE_SYSFS */
+  char value[64];
+} boottune_saved[BOOTTUNE_MAX];
+
+/* the current setting of a sysfs attribute: the [selected] entry of a list */
+static int boottune_read(const char* path, char* value, size_t size) {
+  char buf[256];
+  char* p;
+  char* q;
+  ssize_t n;
+  int fd;
+
+  fd = openat(boottune_sys, path, O_RDONLY | O_CLOEXEC);
+  if( fd == -1 ) return -1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if( n <= 0 ) return -1;
+  buf[n] = '\0';
+  p = strchr(buf, '[');
+  if( (p != NULL) && ((q = strchr(p, ']')) != NULL) ) {
+    p++;
+    *q = '\0';
+  } else {
+    p = buf;
+    p[strcspn(p, "\n")] = '\0';
+  }
+  /* a value that does not fit could not be restored */
+  if( (size_t) snprintf(value, size, "%s", p) >= size ) {
+    errno = EOVERFLOW;
+    return -1;
+  }
+  return 0;
+}
+
+static int boottune_write(const char* path, const char* value) {
+  int fd, ret;
+
+  /* O_TRUNC as in a shell redirection: a no-op on sysfs, needed on a fake tree */
+  fd = openat(boottune_sys, path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if( fd == -1 ) return -1;
+  ret = (write(fd, value, strlen(value)) == (ssize_t) strlen(value)) ? 0 : -1;
+  close(fd);
+  return ret;
+}
+
+/* set one attribute, keeping its first value for the restore */
+static void boottune_set(const char* path, const char* value) {
+  char old[64];
+  int i;
+
+  if( boottune_read(path, old, sizeof(old)) != 0 ) {
+    printk(KERN_WARNING "boottune: %s/%s: %s\n", BOOTTUNE_SYSFS, path, strerror(errno));
+    return;
+  }
+  if( strcmp(old, value) == 0 ) return;
+  if( boottune_write(path, value) != 0 ) {
+    printk(KERN_WARNING "boottune: %s/%s: %s: %s\n", BOOTTUNE_SYSFS, path, value, strerror(errno));
+    return;
+  }
+  printk("boottune: %s/%s: %s -> %s\n", BOOTTUNE_SYSFS, path, old, value);
+  for( i=0; i<boottune_n; i++ ) if( strcmp(boottune_saved[i].path, path) == 0 ) return;
+  if( boottune_n == BOOTTUNE_MAX ) {
+    printk(KERN_WARNING "boottune: more than %d settings; %s/%s stays %s.\n", BOOTTUNE_MAX, BOOTTUNE_SYSFS, path, value);
+    return;
+  }
+  snprintf(boottune_saved[boottune_n].path, sizeof(boottune_saved[boottune_n].path), "%s", path);
+  snprintf(boottune_saved[boottune_n].value, sizeof(boottune_saved[boottune_n].value), "%s", old);
+  boottune_n++;
+}
+
+/* one boottune= item */
+struct boottune_item {
+  const char* dev;   /* NULL for every device */
+  int attr;          /* index in boottune_attr[] */
+  const char* value;
+};
+
+/* give dev ("" for the cpus) the values it has for attribute a; items
+ * without a device apply only where hw is set */
+static void boottune_apply(const struct boottune_item* item, int nitem, int a, const char* dev, int hw) {
+  char path[128];
+  DIR* dir;
+  struct dirent* e;
+  int i, fd;
+
+  for( i=0; i<nitem; i++ ) {
+    if( (item[i].attr != a) || ((item[i].dev == NULL) ? !hw : (strcmp(item[i].dev, dev) != 0)) ) continue;
+    if( a > 0 ) {
+      if( (size_t) snprintf(path, sizeof(path), "block/%s/queue/%s", dev, boottune_attr[a]) < sizeof(path) )
+        boottune_set(path, item[i].value);
+      continue;
+    }
+    fd = openat(boottune_sys, "devices/system/cpu/cpufreq", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if( (fd == -1) || ((dir = fdopendir(fd)) == NULL) ) {
+      printk(KERN_WARNING "boottune: governor: no cpufreq: %s\n", strerror(errno));
+      if( fd != -1 ) close(fd);
+      continue;
+    }
+    while( (e = readdir(dir)) != NULL ) {
+      if( (strncmp(e->d_name, "policy", 6) != 0) ||
+          ((size_t) snprintf(path, sizeof(path), "devices/system/cpu/cpufreq/%s/scaling_governor", e->d_name) >= sizeof(path)) ) continue;
+      boottune_set(path, item[i].value);
+    }
+    closedir(dir);
+  }
+}
+
+static int stage_boottune(void* arg) {
+  struct boottune_item item[BOOTTUNE_MAX];
+  char path[128];
+  char* save;
+  char* p;
+  char* eq;
+  DIR* dir;
+  struct dirent* e;
+  int nitem = 0;
+  int a, fd, hw;
+
+  if( param[iboottune].v == NULL ) return 0;
+  for( p = strtok_r(param[iboottune].v, ",", &save); (p != NULL) && (nitem < BOOTTUNE_MAX); p = strtok_r(NULL, ",", &save) ) {
+    item[nitem].dev = NULL;
+    eq = strchr(p, ':');
+    if( eq != NULL ) {
+      *eq = '\0';
+      item[nitem].dev = p;
+      p = eq + 1;
+    }
+    eq = strchr(p, '=');
+    if( eq != NULL ) *eq = '\0';
+    for( a=0; (boottune_attr[a] != NULL) && (strcmp(p, boottune_attr[a]) != 0); a++ );
+    if( (eq == NULL) || (eq[1] == '\0') || (boottune_attr[a] == NULL) || ((a == 0) && (item[nitem].dev != NULL)) ) {
+      printk(KERN_WARNING "boottune: ignoring \"%s\".\n", p);
+      continue;
+    }
+    item[nitem].attr = a;
+    item[nitem].value = eq + 1;
+    nitem++;
+  }
+  if( nitem == 0 ) return 0;
+
+  boottune_sys = open(BOOTTUNE_SYSFS, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if( boottune_sys == -1 ) {
+    printk(KERN_WARNING "boottune: %s: %s\n", BOOTTUNE_SYSFS, strerror(errno));
+    return 0;
+  }
+  boottune_apply(item, nitem, 0, "", 1);
+
+  fd = openat(boottune_sys, "block", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if( (fd == -1) || ((dir = fdopendir(fd)) == NULL) ) {
+    printk(KERN_WARNING "boottune: %s/block: %s\n", BOOTTUNE_SYSFS, strerror(errno));
+    if( fd != -1 ) close(fd);
+    return 0;
+  }
+  while( (e = readdir(dir)) != NULL ) {
+    /* no block device name comes near the length of a path here */
+    if( (e->d_name[0] == '.') || ((size_t) snprintf(path, sizeof(path), "block/%s/device", e->d_name) >= sizeof(path)) ) continue;
+    /* every-device items go to devices with hardware behind them, not to
+     * loop, ram, zram or device-mapper ones */
+    hw = (faccessat(boottune_sys, path, F_OK, 0) == 0);
+    /* the scheduler first: switching it resets nr_requests */
+    for( a=1; boottune_attr[a] != NULL; a++ ) boottune_apply(item, nitem, a, e->d_name, hw);
+  }
+  closedir(dir);
+  return 0;
+}
+
+/* undo stage_boottune, or list what to undo in param[iboottune_restore] */
+static int boottune_restore(void) {
+  static struct fdout f;
+  int i, ret = 0;
+
+  if( boottune_n == 0 ) return 0;
+  if( param[iboottune_restore].v != NULL ) {
+    f.fd = open(param[iboottune_restore].v, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if( f.fd != -1 ) {
+      for( i=0; i<boottune_n; i++ ) fdout_printf(&f, "%s/%s %s\n", BOOTTUNE_SYSFS, boottune_saved[i].path, boottune_saved[i].value);
+      if( fdout_close(&f) == 0 ) {
+        printk("boottune: %d settings to restore listed in %s.\n", boottune_n, param[iboottune_restore].v);
+        close(boottune_sys);
+        return 0;
+      }
+    }
+    printk(KERN_WARNING "boottune: %s: %s; restoring now.\n", param[iboottune_restore].v, strerror(errno));
+  }
+  /* in order: a scheduler comes back before the nr_requests it resets */
+  for( i=0; i<boottune_n; i++ ) {
+    if( boottune_write(boottune_saved[i].path, boottune_saved[i].value) != 0 ) {
+      printk(KERN_WARNING "boottune: restore %s/%s: %s: %s\n", BOOTTUNE_SYSFS, boottune_saved[i].path, boottune_saved[i].value, strerror(errno));
+      ret = -1;
+    }
+  }
+  close(boottune_sys);
+  if( ret == 0 ) printk("boottune: restored %d settings.\n", boottune_n);
+  return ret;
+}
+
+/* try to mount root=device at /mnt
+ *
+ * note: for zfs, if a copy of /etc/zfs/zpool.cache (when pool is imported) is put in initramfs-source, then
+ * the zfs module can read it and automatically import the pools described in the cache file; the imported
+ * pools can be available to mount here if they were created using standard device names, otherwise
+ * udevd may be required to run before mounting the pool */
+static unsigned long root_mountflags;
+static unsigned long root_devflags; /* for root=, which may hold a rootimage= */
+static char root_data[1024];        /* fs options for root= */
+static int root_mfd = -1; /* detached root mount made by stage_root_prepare */
+
+/* create the root superblock as a detached mount, ready to be put at /mnt */
+static int stage_root_prepare(void* arg) {
+  /* param[imountopt], param[irootflags]: mount(8) style options; as with the
+   * kernel's own root mount, ro unless rw is given */
+  root_mountflags = MS_RDONLY;
+  root_data[0] = '\0';
+  if( (mnt_parse_opts(param[imountopt].v, &root_mountflags, root_data, sizeof(root_data)) != 0) ||
+      ((param[irootflags].v != NULL) && (mnt_parse_opts(param[irootflags].v, &root_mountflags, root_data, sizeof(root_data)) != 0)) ) {
+    printk(KERN_ERR "Invalid root mount options \"%s%s%s\": %s\n", param[imountopt].v,
+           (param[irootflags].v != NULL) ? "," : "", (param[irootflags].v != NULL) ? param[irootflags].v : "", strerror(errno));
+    return EX_USAGE;
+  }
+  /* root= only holds the image, and the upper layer of a rootoverlay=<dir> */
+  root_devflags = root_mountflags;
+  if( param[irootimage].v != NULL ) {
+    root_devflags &= ~MS_RDONLY;
+    if( (param[irootoverlay].v == NULL) || (param[irootoverlay].v[0] != '/') ) root_devflags |= MS_RDONLY;
+  }
+
+  printk("Preparing %s filesystem on %s.\n", param[irootfstype].v, param[iroot].v);
+  root_mfd = mnt_prepare(param[iroot].v, param[irootfstype].v, root_devflags, root_data);
+  if( root_mfd == -1 ) {
+    if( errno == ENOSYS ) {
+      printk("No new mount API in this kernel; %s will be mounted with mount(2).\n", param[iroot].v);
+      return 0;
+    }
+    /* an unknown type; fs_check reports it */
+    if( errno == ENODEV ) return 0;
+    printk(KERN_ERR "time to panic: fsmount: %s\n", strerror(errno));
+    return EX_UNAVAILABLE;
+  }
+  return 0;
+}
+
+static int stage_mount_root(void* arg) {
+  int ret;
+
+  printk("Attempting cmd: mount -t %s -o %s%s%s%s %s /mnt.\n", param[irootfstype].v, param[imountopt].v,
+         (param[irootflags].v != NULL) ? "," : "", (param[irootflags].v != NULL) ? param[irootflags].v : "",
+         (param[irootimage].v == NULL) ? "" : (root_devflags & MS_RDONLY) ? ",ro" : ",rw", param[iroot].v);
+  if( root_mfd != -1 ) ret = mnt_attach(root_mfd, "/mnt");
+  else ret = mount(param[iroot].v, "/mnt", param[irootfstype].v, root_devflags, root_data);
+  root_mfd = -1;
+  if( ret != 0 ) {
+    printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
+    return EX_UNAVAILABLE;
+  }
+  printk("%s mounted successfully.\n", param[iroot].v);
+  return 0;
+}
+
+/* param[irootimage], param[irootimagefstype], param[irootoverlay]:
+ *  the root filesystem is an image file on the filesystem of root=.
+ *  That filesystem is moved from /mnt to ROOTIMAGE_DIR/host and the image
+ *  attached to a loop device and mounted read-only at /mnt; with
+ *  rootoverlay=tmpfs or rootoverlay=<dir on root=>, the image is mounted at
+ *  ROOTIMAGE_DIR/lower instead, and an overlay of it with <dir>/upper and
+ *  <dir>/work at /mnt. The helper mounts are detached afterwards; they live
+ *  on while the loop device and overlay use them, and the root= device can
+ *  be mounted again to reach the image and upper layer. */
+#define ROOTIMAGE_DIR "/rootimage"
+
+static int stage_root_image(void* arg) {
+  char dev[32];
+  char image[512];
+  char upper[512];
+  char data[1600];
+  const char* type;
+  const char* lower = "/mnt";
+  int lfd, ret;
+
+  if( param[irootimage].v == NULL ) return 0;
+  if( (param[irootimage].v[0] != '/') || ((param[irootoverlay].v != NULL) && (strcmp(param[irootoverlay].v, "tmpfs") != 0) && (param[irootoverlay].v[0] != '/')) ) {
+    printk(KERN_ERR "rootimage= and rootoverlay= need absolute paths on the root= filesystem.\n");
+    return EX_USAGE;
+  }
+  mkdir(ROOTIMAGE_DIR, 0700);
+  mkdir(ROOTIMAGE_DIR "/host", 0700);
+  mkdir(ROOTIMAGE_DIR "/lower", 0700);
+  mkdir(ROOTIMAGE_DIR "/rw", 0700);
+  if( mnt_move("/mnt", ROOTIMAGE_DIR "/host") != 0 ) {
+    printk(KERN_ERR "time to panic: mount --move /mnt %s/host: %s\n", ROOTIMAGE_DIR, strerror(errno));
+    return EX_UNAVAILABLE;
+  }
+
+  snprintf(image, sizeof(image), "%s/host%s", ROOTIMAGE_DIR, param[irootimage].v);
+  lfd = loop_attach(image, dev, sizeof(dev));
+  if( lfd == -1 ) {
+    printk(KERN_ERR "rootimage=%s: cannot attach to a loop device: %s\n", param[irootimage].v, strerror(errno));
+    ret = EX_UNAVAILABLE;
+    goto out;
+  }
+  printk("Attached %s to %s (direct I/O %s).\n", param[irootimage].v, dev, loop_direct_io(lfd) ? "on" : "off");
+
+  type = param[irootimagefstype].v;
+  if( (strcmp(type, "auto") == 0) && ((type = fsprobe(dev, NULL)) == NULL) ) {
+    printk(KERN_ERR "rootimagefstype=auto: cannot identify the filesystem in %s: %s\n", param[irootimage].v, strerror(errno));
+    ret = EX_UNAVAILABLE;
+    goto out;
+  }
+  if( param[irootoverlay].v != NULL ) lower = ROOTIMAGE_DIR "/lower";
+  printk("Attempting cmd: mount -t %s -o ro %s %s.\n", type, dev, lower);
+  if( mnt_mount(dev, lower, type, MS_RDONLY, NULL) != 0 ) {
+    printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
+    ret = EX_UNAVAILABLE;
+    goto out;
+  }
+
+  if( param[irootoverlay].v != NULL ) {
+    if( strcmp(param[irootoverlay].v, "tmpfs") == 0 ) {
+      snprintf(upper, sizeof(upper), "%s/rw", ROOTIMAGE_DIR);
+      if( mnt_mount("tmpfs", upper, "tmpfs", 0, "mode=0755") != 0 ) {
+        printk(KERN_ERR "time to panic: mount tmpfs %s: %s\n", upper, strerror(errno));
+        ret = EX_UNAVAILABLE;
+        goto out;
+      }
+    } else snprintf(upper, sizeof(upper), "%s/host%s", ROOTIMAGE_DIR, param[irootoverlay].v);
+    snprintf(data, sizeof(data), "%s/upper", upper);
+    mkdir(data, 0755);
+    snprintf(data, sizeof(data), "%s/work", upper);
+    mkdir(data, 0755);
+    snprintf(data, sizeof(data), "lowerdir=%s,upperdir=%s/upper,workdir=%s/work", lower, upper, upper);
+    printk("Attempting cmd: mount -t overlay -o %s overlay /mnt.\n", data);
+    if( mnt_mount("overlay", "/mnt", "overlay", root_mountflags, data) != 0 ) {
+      printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
+      ret = EX_UNAVAILABLE;
+      goto out;
+    }
+    umount2(ROOTIMAGE_DIR "/rw", MNT_DETACH);
+    umount2(lower, MNT_DETACH);
+  }
+  printk("%s mounted successfully.\n", param[irootimage].v);
+  ret = 0;
+
+out:
+  if( lfd != -1 ) close(lfd);
+  umount2(ROOTIMAGE_DIR "/host", MNT_DETACH);
+  return ret;
+}
+
+#if defined(INCLUDE_ZPOOL_IMPORT)
+/* param[izfs_mount_children]: mount the descendants of the root dataset
+ *  zfs_mount_children=1 mounts, under /mnt, every filesystem below root=
+ *  that has canmount=on and a mountpoint that is not legacy or none,
+ *  before the switch root instead of by the real init one at a time.
+ *  Properties are read with the libzfs handle zpool_import left open; the
+ *  mounts then run as a dependency graph on the stage threads, each after
+ *  the dataset mounted on the nearest directory above it, so independent
+ *  subtrees mount concurrently. The dataset's own properties decide how it
+ *  is mounted, as with zfs mount. A dataset that fails is reported, and the
+ *  ones below it are skipped; the boot goes on. */
+#define ZMOUNT_MAX 256
+
+struct zmount {
+  char name[ZFS_MAX_DATASET_NAME_LEN];
+  char target[512];
+  int dep;
+};
+
+struct zmount_list {
+  struct zmount* zm;
+  int n;
+  const char* rootmp; /* mountpoint of the root dataset */
+};
+
+static int zmount_cmp(const void* a, const void* b) {
+  return strcmp(((const struct zmount*) a)->target, ((const struct zmount*) b)->target);
+}
+
+static int zmount_collect(zfs_handle_t* zhp, void* arg) {
+  struct zmount_list* zl = arg;
+  char mp[ZFS_MAXPROPLEN];
+  const char* rel;
+  size_t len = strlen(zl->rootmp);
+
+  if( (zl->n < ZMOUNT_MAX) && (zfs_prop_get_int(zhp, ZFS_PROP_CANMOUNT) == ZFS_CANMOUNT_ON) &&
+      (zfs_prop_get(zhp, ZFS_PROP_MOUNTPOINT, mp, sizeof(mp), NULL, NULL, 0, B_FALSE) == 0) && (mp[0] == '/') ) {
+    /* where it goes relative to the root dataset, which is at /mnt */
+    rel = mp;
+    if( (len > 1) && (strncmp(mp, zl->rootmp, len) == 0) && ((mp[len] == '/') || (mp[len] == '\0')) ) rel = mp + len;
+    snprintf(zl->zm[zl->n].name, sizeof(zl->zm[zl->n].name), "%s", zfs_get_name(zhp));
+    if( (size_t) snprintf(zl->zm[zl->n].target, sizeof(zl->zm[zl->n].target), "/mnt%s", rel) >= sizeof(zl->zm[zl->n].target) )
+      printk(KERN_WARNING "zfs_mount: %s: mountpoint %s is too long; not mounted.\n", zl->zm[zl->n].name, mp);
+    else zl->n++;
+  }
+  zfs_iter_filesystems(zhp, zmount_collect, zl);
+  zfs_close(zhp);
+  return 0;
+}
+
+static int zmount_one(void* arg) {
+  struct zmount* z = arg;
+
+  if( (mkdir(z->target, 0755) != 0) && (errno != EEXIST) ) {
+    printk(KERN_ERR "zfs_mount: %s: mkdir %s: %s\n", z->name, z->target, strerror(errno));
+    return EX_CANTCREAT;
+  }
+  if( mnt_mount(z->name, z->target, "zfs", 0, "zfsutil") != 0 ) {
+    printk(KERN_ERR "zfs_mount: %s: mount on %s: %s\n", z->name, z->target, strerror(errno));
+    return EX_UNAVAILABLE;
+  }
+  printk("zfs_mount: %s mounted on %s.\n", z->name, z->target);
+  return 0;
+}
+
+static int stage_zfs_mount(void* arg) {
+  struct zmount_list zl = { NULL, 0, "/" };
+  struct dag_node* node = NULL;
+  zfs_handle_t* zhp;
+  char rootmp[ZFS_MAXPROPLEN];
+  size_t tlen;
+  int i, j, failed = 0;
+
+  if( (strcmp(param[irootfstype].v, "zfs") != 0) || (param[izfs_mount_children].v == NULL) ||
+      (strcmp(param[izfs_mount_children].v, "1") != 0) ) goto out;
+  /* the pool may have come from zpool.cache rather than zpool_import= */
+  if( zpool_libzfs == NULL ) zpool_libzfs = libzfs_init();
+  if( zpool_libzfs == NULL ) {
+    printk(KERN_ERR "zfs_mount: unable to initialize libzfs.\n");
+    goto out;
+  }
+  zhp = zfs_open(zpool_libzfs, param[iroot].v, ZFS_TYPE_FILESYSTEM);
+  if( zhp == NULL ) {
+    printk(KERN_ERR "zfs_mount: %s: %s\n", param[iroot].v, libzfs_error_description(zpool_libzfs));
+    goto out;
+  }
+  if( (zfs_prop_get(zhp, ZFS_PROP_MOUNTPOINT, rootmp, sizeof(rootmp), NULL, NULL, 0, B_FALSE) == 0) && (rootmp[0] == '/') )
+    zl.rootmp = rootmp;
+  zl.zm = calloc(ZMOUNT_MAX, sizeof(*zl.zm));
+  if( zl.zm == NULL ) {
+    zfs_close(zhp);
+    goto out;
+  }
+  zfs_iter_filesystems(zhp, zmount_collect, &zl);
+  zfs_close(zhp);
+  if( zl.n == 0 ) {
+    printk("zfs_mount: no datasets to mount below %s.\n", param[iroot].v);
+    goto out;
+  }
+
+  /* sorted, a dataset's parent mount is the nearest earlier prefix */
+  qsort(zl.zm, zl.n, sizeof(*zl.zm), zmount_cmp);
+  node = calloc(zl.n, sizeof(*node));
+  if( node == NULL ) goto out;
+  for( i=0; i<zl.n; i++ ) {
+    zl.zm[i].dep = -1;
+    for( j=i-1; j>=0; j-- ) {
+      tlen = strlen(zl.zm[j].target);
+      if( (strncmp(zl.zm[i].target, zl.zm[j].target, tlen) == 0) && (zl.zm[i].target[tlen] == '/') ) {
+        zl.zm[i].dep = j;
+        break;
+      }
+    }
+    node[i].name = zl.zm[i].name;
+    node[i].run = zmount_one;
+    node[i].arg = &zl.zm[i];
+    node[i].deps = &zl.zm[i].dep;
+    node[i].ndeps = (zl.zm[i].dep >= 0);
+    node[i].flags = DAG_UNTIMED;
+  }
+  printk("zfs_mount: mounting %d datasets below %s.\n", zl.n, param[iroot].v);
+  dag_run(node, zl.n, DAG_THREADS);
+  for( i=0; i<zl.n; i++ ) if( node[i].state != DAG_DONE ) failed++;
+  if( failed > 0 ) printk(KERN_WARNING "zfs_mount: %d of %d datasets not mounted.\n", failed, zl.n);
+
+out:
+  free(node);
+  free(zl.zm);
+  if( zpool_libzfs != NULL ) libzfs_fini(zpool_libzfs);
+  zpool_libzfs = NULL;
+  return 0;
+}
+#endif
+
+/* check to see if the mounted root filesystem has an executable init program
+ *  note: other stages may be running, so use a directory fd instead of chdir */
+static int stage_init_check(void* arg) {
+  int dfd;
+
+  dfd = open("/mnt", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if( (dfd == -1) || (faccessat(dfd, param[iinit].v+1, X_OK, 0) != 0) ) {
+    printk(KERN_ERR "access X_OK: %s\n", strerror(errno));
+    if( dfd != -1 ) close(dfd);
+    printk(KERN_ERR "The init program /mnt/%s is not present or not executable.\n", param[iinit].v+1);
+    printk(KERN_ERR "Aborting boot process: no init program.\n");
+    printk("Unmounting %s.\n", param[iroot].v);
+    if( umount("/mnt") == -1 ) {
+      printk(KERN_ERR "umount: %s\n", strerror(errno));
+      printk(KERN_ERR "Failed to umount %s.\n", param[iroot].v);
+    } else printk("Successfully unmounted %s.\n", param[iroot].v);
+    return EX_UNAVAILABLE;
+  }
+  close(dfd);
+  printk("Init program /mnt/%s is present and executable.\n", param[iinit].v+1);
+  /* read it and its libraries in while the root is switched */
+  warm_start("/mnt", param[iinit].v);
+  return 0;
+}
+
+enum {
+	S_MOUNT_PROC,
+	S_MOUNT_DEV,
+	S_MOUNT_SYS,
+	S_CMDLINE,
+	S_MODULES,
+	S_FS_PROBE,
+	S_FS_CHECK,
+	S_ZFS_CHECK,
+#if defined(INCLUDE_ZPOOL_IMPORT)
+	S_ZPOOL_IMPORT,
+#endif
+	S_ROOT_WAIT,
+	S_RESUME,
+	S_ZRAM,
+	S_BOOTTUNE,
+	S_ROOT_PREPARE,
+	S_MOUNT_ROOT,
+	S_ROOT_IMAGE,
+#if defined(INCLUDE_ZPOOL_IMPORT)
+	S_ZFS_MOUNT,
+#endif
+	S_INIT_CHECK,
+	S_LAST
+};
+
+#if defined(INCLUDE_ZPOOL_IMPORT)
+#define S_ZPOOL_DEP , S_ZPOOL_IMPORT
+#define S_ZFS_MOUNT_DEP , S_ZFS_MOUNT
+#else
+#define S_ZPOOL_DEP
+#define S_ZFS_MOUNT_DEP
+#endif
+
+static struct dag_node stage[] = {
+  [S_MOUNT_PROC]   = { "mount_proc",   stage_mount_proc,   NULL, NODEPS },
+  [S_MOUNT_DEV]    = { "mount_dev",    stage_mount_dev,    NULL, NODEPS },
+  [S_MOUNT_SYS]    = { "mount_sys",    stage_mount_sys,    NULL, NODEPS },
+  [S_CMDLINE]      = { "cmdline",      stage_cmdline,      NULL, DEPS(S_MOUNT_PROC) },
+  [S_MODULES]      = { "modules",      stage_modules,      NULL, DEPS(S_CMDLINE) },
+  [S_FS_PROBE]     = { "fs_probe",     stage_fs_probe,     NULL, DEPS(S_CMDLINE, S_MODULES, S_ROOT_WAIT) },
+  [S_FS_CHECK]     = { "fs_check",     stage_fs_check,     NULL, DEPS(S_CMDLINE, S_MODULES, S_FS_PROBE) },
+  [S_ZFS_CHECK]    = { "zfs_check",    stage_zfs_check,    NULL, DEPS(S_CMDLINE) },
+#if defined(INCLUDE_ZPOOL_IMPORT)
+  [S_ZPOOL_IMPORT] = { "zpool_import", stage_zpool_import, NULL, DEPS(S_MOUNT_DEV, S_MOUNT_SYS, S_CMDLINE, S_MODULES, S_RESUME) },
+#endif
+  [S_ROOT_WAIT]    = { "root_wait",    stage_root_wait,    NULL, DEPS(S_MOUNT_DEV, S_MOUNT_SYS, S_CMDLINE, S_MODULES) },
+  [S_RESUME]       = { "resume",       stage_resume,       NULL, DEPS(S_MOUNT_DEV, S_MOUNT_SYS, S_CMDLINE, S_MODULES) },
+  [S_ZRAM]         = { "zram",         stage_zram,         NULL, DEPS(S_MOUNT_DEV, S_MOUNT_SYS, S_CMDLINE, S_MODULES, S_RESUME) },
+  [S_BOOTTUNE]     = { "boottune",     stage_boottune,     NULL, DEPS(S_MOUNT_SYS, S_CMDLINE, S_MODULES, S_ROOT_WAIT) },
+  [S_ROOT_PREPARE] = { "root_prepare", stage_root_prepare, NULL, DEPS(S_MOUNT_DEV, S_CMDLINE, S_MODULES, S_ROOT_WAIT, S_RESUME, S_FS_PROBE S_ZPOOL_DEP) },
+  [S_MOUNT_ROOT]   = { "mount_root",   stage_mount_root,   NULL, DEPS(S_ROOT_PREPARE, S_FS_CHECK, S_ZFS_CHECK) },
+  [S_ROOT_IMAGE]   = { "root_image",   stage_root_image,   NULL, DEPS(S_MOUNT_DEV, S_MOUNT_ROOT) },
+#if defined(INCLUDE_ZPOOL_IMPORT)
+  [S_ZFS_MOUNT]    = { "zfs_mount",    stage_zfs_mount,    NULL, DEPS(S_ROOT_IMAGE) },
+#endif
+  [S_INIT_CHECK]   = { "init_check",   stage_init_check,   NULL, DEPS(S_ROOT_IMAGE S_ZFS_MOUNT_DEP) }
+};
+
+int main(int argc, char* argv[]) {
+ /*** variables */
+
+ int ret;
+ int tl_all, tl; /* timeline slots */
+ int oldroot; /* initramfs root, emptied after the switch */
+ struct reclaim_stats rs;
+ char path[264];
+ unsigned long long warm_bytes;
+
+ /*** program */
+
+ /* init returning to the kernel ends in a panic; get pending lines out first */
+ atexit(klog_flush_all);
+ tl_all = timeline_begin("initramfs");
+ atexit(timeline_report);
+ printk(KERN_NOTICE "foobarz-init, version %s: booting initramfs.\n", FOOBARZ_INIT_VERSION);
+
+ /* run the boot stages up to a mounted root with an init program */
+ ret = dag_run(stage, S_LAST, DAG_THREADS);
+ if( ret != 0 ) return ret;
+ klog_flush();
 
  /* switch the root / from initramfs to the mounted new root device at /mnt.
   * 
-  * note: after this switch, it is not possible to access the initramfs files anymore,
-  * yet they consume ram memory unless they are deleted here before switching.
-  * Any programs that are run after clearing the initramfs and switching root must exist on the new root.
-  * This program may safely delete itself (/init) since it is already in ram and executing.
-  * If you have installed additional files and programs in initramfs that consume significant ram,
-  * then you need to insert additional code here to delete those files (carefully). */
-
- /* delete files off of initramfs to free ram memory */
- printk("Freeing memory from initramfs...\n");
- if( unlink(argv[0]) != 0 ) printk("unlink %s: %s\n", argv[0], strerror(errno));
- else printk("%s %s", argv[0], "deleted from initramfs.\n");
+  * note: after this switch, the initramfs files cannot be reached by path anymore,
+  * yet they consume ram memory unless they are deleted. A directory fd on the
+  * initramfs root is kept across the switch so the whole tree (this program,
+  * zpool.cache, helper binaries, modules, firmware) can be deleted afterwards.
+  * Any programs that are run after switching root must exist on the new root.
+  *
+  * The stage threads have all exited by now; chdir and chroot below change the
+  * whole process. The warm threads work from their own fd on the new root and
+  * do not mind. */
+ oldroot = reclaim_open();
 
  /* switch root */
+ tl = timeline_begin("switch_root");
  printk("Beginning switch root procedure.\n");
 
  printk("(1) Attempting cmd: mount --move /dev /mnt/dev \n");
- if( mount("/dev", "/mnt/dev", NULL, MS_MOVE, NULL) != 0 ) {
-  printk("time to panic: mount: %s\n", strerror(errno));
+ if( mnt_move("/dev", "/mnt/dev") != 0 ) {
+  printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
 
  printk("(2) Attempting cmd: mount --move /proc /mnt/proc \n");
- if( mount("/proc", "/mnt/proc", NULL, MS_MOVE, NULL) != 0 ) {
-  printk("time to panic: mount: %s\n", strerror(errno));
+ if( mnt_move("/proc", "/mnt/proc") != 0 ) {
+  printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
  
  printk("(3) Attempting cmd: mount --move /sys /mnt/sys \n");
- if( mount("/sys", "/mnt/sys", NULL, MS_MOVE, NULL) != 0 ) {
-  printk("time to panic: mount: %s\n", strerror(errno));
+ if( mnt_move("/sys", "/mnt/sys") != 0 ) {
+  printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
 
+ /* the zram_tmp= scratch tmpfs is not needed to boot; left behind, it goes */
+ if( zram_tmp_dir[0] != '\0' ) {
+  snprintf(path, sizeof(path), "/mnt%s", zram_tmp_dir);
+  printk("(3a) Attempting cmd: mount --move %s %s \n", ZRAM_TMP, path);
+  if( mnt_move(ZRAM_TMP, path) != 0 ) {
+   printk(KERN_WARNING "mount: %s; no scratch tmpfs at %s.\n", strerror(errno), zram_tmp_dir);
+   umount2(ZRAM_TMP, MNT_DETACH);
+  }
+ }
+
  printk("(4) Attempting cmd: chdir /mnt \n");
  if( chdir("/mnt") != 0 ) {
-  printk("time to panic: chdir: %s\n", strerror(errno));
+  printk(KERN_ERR "time to panic: chdir: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
 
  printk("(5) Attempting cmd: mount --move . / \n");
- if( mount(".", "/", NULL, MS_MOVE, NULL) != 0 ) {
-  printk("time to panic: mount: %s\n", strerror(errno));
+ if( mnt_move(".", "/") != 0 ) {
+  printk(KERN_ERR "time to panic: mount: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
  
  printk("(6) Attempting cmd: chroot . \n");
  if( chroot(".") != 0 ) {
-  printk("time to panic: chroot: %s\n", strerror(errno));
+  printk(KERN_ERR "time to panic: chroot: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
  
  printk("(7) Attempting cmd: chdir / \n");
  if( chdir("/") != 0 ) {
-  printk("time to panic: chdir: %s\n", strerror(errno));
+  printk(KERN_ERR "time to panic: chdir: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
  printk("Completed switch root procedure.\n");
+ timeline_end(tl);
+
+ /* delete files off of initramfs to free ram memory */
+ if( oldroot != -1 ) {
+   tl = timeline_begin("free_initramfs");
+   printk("Freeing memory from initramfs...\n");
+   reclaim_tree(oldroot, &rs);
+   printk("Freed %llu kB from initramfs (%lu files, %lu directories, %lu errors).\n",
+          rs.bytes / 1024, rs.files, rs.dirs, rs.errors);
+   timeline_end(tl);
+ }
 
  /* check for "console=" kernel parameter and switch
   *  stdin, stdout, and stderr to named console device
@@ -521,21 +4790,31 @@ int main(int argc, char* argv[]) {
      dup2(0, 1);
      dup2(0, 2);
    } else {
-     printk("access F_OK: %s\n", strerror(errno));
-     printk("Could not access device: %s!\n", param[iconsole].v);
-     printk("Console redirection to device %s aborted!\n", param[iconsole].v);
+     printk(KERN_WARNING "access F_OK: %s\n", strerror(errno));
+     printk(KERN_WARNING "Could not access device: %s!\n", param[iconsole].v);
+     printk(KERN_WARNING "Console redirection to device %s aborted!\n", param[iconsole].v);
    }
    chdir("/");
  }
 
- printk("Execing: \"%s %s\" to boot mounted root system.\n", param[iinit].v, param[irunlevel].v);
+ tl = timeline_begin("init_warm");
+ ret = warm_wait(&warm_bytes);
+ if( ret > 0 ) printk("Warmed %d init files (%llu kB).\n", ret, warm_bytes / 1024);
+ timeline_end(tl);
+
+ boottune_restore();
+
+ timeline_end(tl_all);
+ timeline_report();
+ if( timeline_write(TIMELINE_PATH) != 0 )
+   printk(KERN_WARNING "Unable to write %s: %s\n", TIMELINE_PATH, strerror(errno));
+ printk(KERN_NOTICE "Execing: \"%s %s\" to boot mounted root system.\n", param[iinit].v, param[irunlevel].v);
 
- /* free resources held to this point */
- free(cmdline);
- free(miscproc_buff);
+ klog_flush_all();
+ ra_start();
 
  if( execl(param[iinit].v, param[irunlevel].v, (char *) NULL ) != 0 ) {  
-  printk("time to panic: execl: %s\n", strerror(errno));
+  printk(KERN_ERR "time to panic: execl: %s\n", strerror(errno));
   return EX_UNAVAILABLE;
  }
 }
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Boot latency benchmark: boots foobarz-init <runs> times through
+# test/harness.sh and reports the length of each timeline phase and the
+# wall time of a whole run (namespace setup included), in microseconds.
+# With $EXEC_STAMP set (see test/harness.sh), exec_to_log is the time from
+# the exec of /init to its first log line.
+#
+# usage: bench.sh <init> <stub-init> <workdir> <runs> [kernel parameters...]
+
+[ $# -ge 4 ] || { echo "usage: $0 <init> <stub-init> <workdir> <runs> [kernel parameters...]" >&2; exit 64; }
+init=$1
+stub=$2
+work=$3
+runs=$4
+shift 4
+here=$(dirname "$0")
+
+mkdir -p "$work"
+: > "$work/phases"
+i=0
+while [ $i -lt "$runs" ]; do
+  i=$((i + 1))
+  sh "$here/harness.sh" "$init" "$stub" "$work/run" "$@" || exit 1
+  if [ "$(cat "$work/run/rc")" != 0 ]; then
+    echo "run $i failed (rc $(cat "$work/run/rc")); see $work/run/kmsg" >&2
+    exit 1
+  fi
+  # phase length from the boottime columns; then the wall time of the run
+  awk '!/^#/ && $3 > 0 { print $1, $3 - $2 }' "$work/run/dev/.foobarz-init.timeline" >> "$work/phases"
+  if [ -f "$work/run/dev/.exec-stamp" ]; then
+    awk -v t0="$(cat "$work/run/dev/.exec-stamp")" '$1 == "initramfs" { print "exec_to_log", $2 - t0 }' \
+      "$work/run/dev/.foobarz-init.timeline" >> "$work/phases"
+  fi
+  echo "wall $(cat "$work/run/wall_us")" >> "$work/phases"
+done
+
+echo "$runs runs of: $init $*"
+awk '
+  !($1 in n) { order[++np] = $1; min[$1] = $2 }
+  { n[$1]++; sum[$1] += $2; if( $2 < min[$1] ) min[$1] = $2; if( $2 > max[$1] ) max[$1] = $2 }
+  END {
+    printf "%-20s %6s %10s %10s %10s\n", "phase", "runs", "mean_us", "min_us", "max_us"
+    for( i=1; i<=np; i++ ) { p = order[i]; printf "%-20s %6d %10.0f %10d %10d\n", p, n[p], sum[p] / n[p], min[p], max[p] }
+  }' "$work/phases"
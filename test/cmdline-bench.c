@@ -0,0 +1,130 @@
+/* micro-benchmark of the kernel cmdline parser (make cmdline-bench)
+ *
+ * Builds synthetic command lines of a few KB up to 64 KB: unknown
+ * parameters, flags and quoted values with blanks, as a line with many
+ * driver options would have, then every registered parameter once at the
+ * end, so that a scan for one has to cross the whole line. For each line,
+ * reports the time of
+ *
+ *   split    param_next() over the whole line, with a param_lookup() per
+ *            parameter, as stage_cmdline() does (copying the line in, since
+ *            it is split in place, is timed apart and taken off)
+ *   strstr   the parser this replaced: one strstr() over the line for each
+ *            registered name; its cost grows with the registry, so it is
+ *            also given per name, while that of split does not
+ *
+ * and the time of one param_lookup(), for a registered name and for an
+ * unknown one. The program proper is compiled in, with its main() renamed.
+ */
+#define main foobarz_init_main
+#include "../foobarz-init.c"
+#undef main
+
+#define BENCH_NS_MIN 200000000LL /* run each measurement at least 0.2 s */
+#define BENCH_BATCH  64          /* calls between two clock readings */
+
+static long long bench_ns(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (long long) t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* a line of about size bytes; returns its length */
+static size_t bench_line(char* line, size_t size) {
+  static const char* const unknown[] = { "quiet", "splash", "nvme_core.default_ps_max_latency_us=0",
+    "i915.enable_psr=0", "systemd.unit=multi-user.target", "acpi_osi=\"Windows 2015\"",
+    "video=HDMI-A-1:1920x1080@60", "mitigations=auto,nosmt" };
+  size_t len = 0;
+  int i = 0;
+
+  while( len + 64 + 32 * ilastparam < size ) {
+    if( i % 3 == 0 ) len += snprintf(line + len, size - len, "\"x%d.opt=a b c\" ", i);
+    else len += snprintf(line + len, size - len, "%s ", unknown[i % 8]);
+    i++;
+  }
+  for( i=0; i<ilastparam; i++ ) len += snprintf(line + len, size - len, "%s=v%d ", param[i].n, i);
+  line[len] = '\0';
+  return len;
+}
+
+static void bench_split(const char* line, char* work, size_t len, long long* known) {
+  char* args;
+  char* name;
+  char* val;
+
+  memcpy(work, line, len + 1);
+  args = work;
+  while( *args != '\0' ) {
+    args = param_next(args, &name, &val);
+    if( param_lookup(name) >= 0 ) (*known)++;
+  }
+}
+
+static int bench_count(const char* line, char* work) {
+  char* args = strcpy(work, line);
+  char* name;
+  char* val;
+  int n = 0;
+
+  for( ; *args != '\0'; n++ ) args = param_next(args, &name, &val);
+  return n;
+}
+
+static void bench_strstr(const char* line, long long* known) {
+  char key[64];
+  int i;
+
+  for( i=0; i<ilastparam; i++ ) {
+    snprintf(key, sizeof(key), " %s=", param[i].n);
+    if( strstr(line, key) != NULL ) (*known)++;
+  }
+}
+
+/* ns per call of what, repeated until BENCH_NS_MIN */
+#define BENCH(result, what) do { \
+    long long t0_ = bench_ns(), n_ = 0, t_; \
+    int b_; \
+    do { \
+      for( b_=0; b_<BENCH_BATCH; b_++ ) { what; } \
+      n_ += BENCH_BATCH; \
+    } while( (t_ = bench_ns() - t0_) < BENCH_NS_MIN ); \
+    result = (double) t_ / n_; \
+  } while( 0 )
+
+int main(void) {
+  static const size_t sizes[] = { 2048, 4096, 16384, 65536 };
+  char* line;
+  char* work;
+  size_t len, k;
+  long long known = 0;
+  double copy, split, scan, hit, miss;
+  volatile int sink = 0;
+
+  klog_set_threshold(0); /* nothing here is for the host's /dev/kmsg */
+  if( param_hash_init() != 0 ) {
+    fprintf(stderr, "no collision-free hash seed\n");
+    return 1;
+  }
+  line = malloc(sizes[3]);
+  work = malloc(sizes[3]);
+  if( (line == NULL) || (work == NULL) ) return 1;
+
+  printf("%d registered parameters\n", (int) ilastparam);
+  printf("%8s %8s %10s %10s %12s %14s\n", "bytes", "params", "split_us", "strstr_us", "split_ns/B", "strstr_us/name");
+  for( k=0; k<sizeof(sizes)/sizeof(sizes[0]); k++ ) {
+    len = bench_line(line, sizes[k]);
+    BENCH(copy, memcpy(work, line, len + 1));
+    BENCH(split, bench_split(line, work, len, &known));
+    BENCH(scan, bench_strstr(line, &known));
+    split -= copy;
+    printf("%8lu %8d %10.2f %10.2f %12.3f %14.3f\n", (unsigned long) len, bench_count(line, work),
+           split / 1000, scan / 1000, split / len, scan / 1000 / ilastparam);
+  }
+
+  BENCH(hit, sink += param_lookup("rootimagefstype"));
+  BENCH(miss, sink += param_lookup("nvme_core.default_ps_max_latency_us"));
+  (void) sink;
+  printf("param_lookup: %.1f ns registered, %.1f ns unknown\n", hit, miss);
+  return (known > 0) ? 0 : 1;
+}
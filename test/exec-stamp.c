@@ -0,0 +1,23 @@
+/* exec-stamp <file> <program> [args...]: writes CLOCK_BOOTTIME, in
+ * microseconds, to <file> and execs <program> in the same process.
+ * The harness runs /init through it; the "initramfs" phase of the
+ * timeline starts at the first log line, so the difference between the
+ * two is the time exec and the libc's start-up took (see test/bench.sh).
+ */
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[]) {
+  struct timespec t;
+  FILE* out;
+
+  if( argc < 3 ) return 64;
+  out = fopen(argv[1], "w");
+  if( out == NULL ) return 1;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  fprintf(out, "%lld\n", (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000);
+  if( fclose(out) != 0 ) return 1;
+  execv(argv[2], argv + 2);
+  return 1;
+}
@@ -0,0 +1,80 @@
+#!/bin/sh
+# Boot foobarz-init once, unprivileged, in new user, mount and PID
+# namespaces; see "make test" and "make bench".
+#
+# usage: harness.sh <init> <stub-init> <outdir> [kernel parameters...]
+#
+# <init> must be built with -DPROC_CMDLINE='"/cmdline"'. It runs as PID 1,
+# chrooted into a private tmpfs initramfs that holds it and /cmdline:
+#
+#   /dev     <outdir>/dev, a plain directory standing in for devtmpfs: kmsg
+#            is a FIFO the harness drains into <outdir>/kmsg, ttyH0 a file
+#            for console= tests; the timeline and the stub's report land here
+#   /sys     <outdir>/sys, a copy of $SYSFS (a fake sysfs tree) if set
+#   /newroot the new root: a read-only overlay of <outdir>/root, which holds
+#            the stub as /sbin/init
+#
+# Both are mount points already, so foobarz-init uses them as they are and
+# nothing of the host's /dev or /sys is touched. The parameters given are
+# appended to "root=overlay rootfstype=overlay rootflags=lowerdir=..." and
+# so override it. Afterwards <outdir> holds:
+#
+#   rc          exit status of the namespace: 0 once the stub ran
+#   kmsg        the log, one "<level>line" record per write
+#   console     stdout and stderr of foobarz-init before console=
+#   wall_us     wall time of the whole run
+#   dev/.foobarz-init.timeline, dev/stub-init.out (see test/stub-init.c)
+#   dev/.exec-stamp  with $EXEC_STAMP set to a build of test/exec-stamp.c,
+#                    the boot time at which /init was exec'd
+
+set -e
+[ $# -ge 3 ] || { echo "usage: $0 <init> <stub-init> <outdir> [kernel parameters...]" >&2; exit 64; }
+init=$(realpath "$1")
+stub=$(realpath "$2")
+stamp=${EXEC_STAMP:+$(realpath "$EXEC_STAMP")}
+out=$3
+shift 3
+PATH=$PATH:/usr/sbin:/sbin
+
+rm -rf "$out"
+mkdir -p "$out/dev" "$out/sys" "$out/rfs" "$out/root/sbin" "$out/root/dev" "$out/root/proc" "$out/root/sys" "$out/root/mnt"
+out=$(realpath "$out")
+cp "$stub" "$out/root/sbin/init"
+: > "$out/dev/ttyH0"
+mkfifo "$out/dev/kmsg"
+[ -z "$SYSFS" ] || cp -a "$SYSFS/." "$out/sys/"
+printf 'root=overlay rootfstype=overlay rootflags=lowerdir=/newroot:/newroot.empty %s\n' "$*" > "$out/cmdline"
+
+# foobarz-init closes /dev/kmsg at exec, and its readahead helper may write
+# later: hold a writer open so that cat only sees the end of the log once
+# the run is over
+cat "$out/dev/kmsg" > "$out/kmsg" &
+drain=$!
+exec 3> "$out/dev/kmsg"
+
+start=$(date +%s%N)
+set +e
+unshare --user --map-root-user --mount --pid --fork --propagation private sh -c '
+  set -e
+  out=$1
+  mount -t tmpfs -o mode=0755 initramfs "$out/rfs"
+  cd "$out/rfs"
+  mkdir proc dev sys mnt newroot newroot.empty
+  cp "$2" init
+  cp "$out/cmdline" cmdline
+  mount --bind "$out/dev" dev
+  mount --bind "$out/sys" sys
+  mount --bind "$out/root" newroot
+  if [ -n "$3" ]; then
+    cp "$3" exec-stamp
+    exec chroot . /exec-stamp /dev/.exec-stamp /init
+  fi
+  exec chroot . /init
+' harness "$out" "$init" "$stamp" 3>&- < /dev/null > "$out/console" 2>&1
+echo $? > "$out/rc"
+end=$(date +%s%N)
+set -e
+echo $(( (end - start) / 1000 )) > "$out/wall_us"
+
+exec 3>&-
+wait $drain
@@ -0,0 +1,93 @@
+#!/bin/sh
+# Regression tests for the boot flow, each one boot through test/harness.sh.
+#
+# usage: run-tests.sh <init> <stub-init> <workdir>
+#
+# Prints "ok N - ..." or "not ok N - ..." per check; exits 1 if any failed.
+# The output of a run stays in <workdir>/<case> for a look afterwards.
+
+[ $# -eq 3 ] || { echo "usage: $0 <init> <stub-init> <workdir>" >&2; exit 64; }
+init=$1
+stub=$2
+work=$3
+here=$(dirname "$0")
+n=0
+failed=0
+
+check() {
+  n=$((n + 1))
+  if eval "$2"; then echo "ok $n - $1"
+  else
+    echo "not ok $n - $1"
+    failed=1
+  fi
+}
+
+boot() {
+  o=$work/$1
+  shift
+  sh "$here/harness.sh" "$init" "$stub" "$o" "$@"
+}
+
+mkdir -p "$work"
+
+# a plain boot ends at the stub, with the runlevel as argv[0]
+boot plain
+check "plain boot reaches the real init" '[ "$(cat $o/rc)" = 0 ] && grep -qx "pid 1" $o/dev/stub-init.out'
+check "runlevel defaults to 3" 'grep -qx "argv\[0\] 3" $o/dev/stub-init.out'
+check "no fd of foobarz-init leaks into the real init" '! grep -q leaked $o/dev/stub-init.out'
+check "log ends with the exec" 'tail -n 1 $o/kmsg | grep -q "Execing: \"/sbin/init 3\""'
+check "timeline is written to the private /dev" 'head -n 1 $o/dev/.foobarz-init.timeline | grep -q "timeline v1"'
+check "timeline has every boot stage finished" \
+  'for p in initramfs mount_proc cmdline root_prepare mount_root init_check switch_root; do
+     awk -v p=$p "\$1 == p && \$3 > 0 { f = 1 } END { exit !f }" $o/dev/.foobarz-init.timeline || exit 1
+   done'
+
+boot runlevel runlevel=5
+check "runlevel= is argv[0]" 'grep -qx "argv\[0\] 5" $o/dev/stub-init.out'
+
+boot quoted '"runlevel=S"' -- runlevel=9
+check "quoted parameter is taken and -- ends the kernel part" 'grep -qx "argv\[0\] S" $o/dev/stub-init.out'
+
+boot console console=ttyH0
+check "console= reopens fds 0-2 on the console" \
+  '[ "$(grep -c "^fd [012] /dev/ttyH0$" $o/dev/stub-init.out)" = 3 ]'
+
+boot loglevel init_loglevel=4
+# lines logged before the cmdline is read cannot be held to it
+check "init_loglevel= drops lines at or above it" '[ "$(cat $o/rc)" = 0 ] && ! grep -q "Execing" $o/kmsg'
+
+# failure paths: the run ends in foobarz-init with an error, not at the stub
+boot noinit init=/sbin/missing
+check "missing init fails the boot" '[ "$(cat $o/rc)" != 0 ] && [ ! -e $o/dev/stub-init.out ]'
+check "missing init is logged as an error" 'grep -q "^<3>.*/sbin/missing" $o/kmsg'
+
+boot noroot root=/nonexistent rootfstype=ext4 rootflags=
+check "unmountable root fails the boot" '[ "$(cat $o/rc)" != 0 ] && [ ! -e $o/dev/stub-init.out ]'
+check "root failure skips the stages after it" 'grep -q "init_check: skipped" $o/kmsg'
+
+boot badopt rootflags=nofail
+check "rejected mount option fails with EX_USAGE" '[ "$(cat $o/rc)" = 64 ]'
+
+# boottune= against a fake sysfs tree: tuned during the boot, restored after
+sys=$work/sysfs
+rm -rf "$sys"
+mkdir -p "$sys/devices/system/cpu/cpufreq/policy0" "$sys/block/sda/queue" "$sys/block/sda/device" "$sys/block/loop0/queue"
+echo schedutil > "$sys/devices/system/cpu/cpufreq/policy0/scaling_governor"
+for d in sda loop0; do
+  echo "[mq-deadline] kyber none" > "$sys/block/$d/queue/scheduler"
+  echo 128 > "$sys/block/$d/queue/read_ahead_kb"
+done
+SYSFS=$sys boot boottune boottune=governor=performance,scheduler=none,loop0:read_ahead_kb=1024
+check "boottune= sets the governor and schedulers" \
+  'grep -q "policy0/scaling_governor: schedutil -> performance" $o/kmsg &&
+   grep -q "sda/queue/scheduler: mq-deadline -> none" $o/kmsg &&
+   grep -q "loop0/queue/read_ahead_kb: 128 -> 1024" $o/kmsg'
+check "boottune= leaves loop devices' schedulers alone" '! grep -q "loop0/queue/scheduler" $o/kmsg'
+check "boottune= restores the values before exec" \
+  'grep -q "restored 3 settings" $o/kmsg &&
+   [ "$(cat $o/sys/devices/system/cpu/cpufreq/policy0/scaling_governor)" = schedutil ] &&
+   [ "$(cat $o/sys/block/loop0/queue/read_ahead_kb)" = 128 ]'
+
+echo "1..$n"
+exit $failed
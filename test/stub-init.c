@@ -0,0 +1,54 @@
+/* stub real init for the namespace harness (test/harness.sh)
+ *
+ * foobarz-init execs this as the real init. It writes what it was handed
+ * to /dev/stub-init.out, a file the harness reads back after the run:
+ *
+ *   pid 1
+ *   argv[0] 3
+ *   fd 0 /dev/ttyS0
+ *   fd 3 leaked /dev/kmsg     (an fd without O_CLOEXEC in foobarz-init)
+ *
+ * then exits; as PID 1 of the harness's PID namespace, that ends the run.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdlib.h>
+
+static void fd_target(int fd, char* buf, size_t size) {
+  char path[64];
+  ssize_t n;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  n = readlink(path, buf, size - 1);
+  if( n < 0 ) n = 0;
+  buf[n] = '\0';
+}
+
+int main(int argc, char* argv[]) {
+  char target[256];
+  DIR* dir;
+  struct dirent* e;
+  FILE* out;
+  int i, fd;
+
+  out = fopen("/dev/stub-init.out", "w");
+  if( out == NULL ) return 1;
+  fprintf(out, "pid %d\n", (int) getpid());
+  for( i=0; i<argc; i++ ) fprintf(out, "argv[%d] %s\n", i, argv[i]);
+  for( fd=0; fd<3; fd++ ) {
+    fd_target(fd, target, sizeof(target));
+    fprintf(out, "fd %d %s\n", fd, (target[0] != '\0') ? target : "closed");
+  }
+  /* anything else open was inherited from foobarz-init */
+  dir = opendir("/proc/self/fd");
+  while( (dir != NULL) && ((e = readdir(dir)) != NULL) ) {
+    fd = atoi(e->d_name);
+    if( (e->d_name[0] == '.') || (fd < 3) || (fd == dirfd(dir)) || (fd == fileno(out)) ) continue;
+    fd_target(fd, target, sizeof(target));
+    fprintf(out, "fd %d leaked %s\n", fd, target);
+  }
+  if( dir != NULL ) closedir(dir);
+  return (fclose(out) == 0) ? 0 : 1;
+}